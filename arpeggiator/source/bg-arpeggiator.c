@@ -9,8 +9,27 @@
 #include <lv2/lv2plug.in/ns/ext/atom/forge.h>
 #include <lv2/lv2plug.in/ns/ext/log/logger.h>
 #include <lv2/lv2plug.in/ns/ext/midi/midi.h>
+#include <lv2/lv2plug.in/ns/ext/options/options.h>
+#include <lv2/lv2plug.in/ns/ext/state/state.h>
 #include "lv2/lv2plug.in/ns/ext/time/time.h"
 #include <lv2/lv2plug.in/ns/ext/urid/urid.h>
+#include <lv2/lv2plug.in/ns/ext/worker/worker.h>
+
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "../../common/layout.h"
+#include "../../common/midi_writer.h"
+#include "../../common/perf_counters.h"
+#include "../../common/plugin_state.h"
+#include "../../common/random.h"
+#include "../../common/shared_clock.h"
+#include "../../common/sounding_notes.h"
+#include "../../common/step_clock.h"
+#include "../../common/transport.h"
 
 #ifndef DEBUG
 #define DEBUG 0
@@ -18,17 +37,13 @@
 #define debug_print(...) \
     ((void)((DEBUG) ? fprintf(stderr, __VA_ARGS__) : 0))
 
-#define NUM_VOICES 16
+#define MAX_HELD_NOTES 128 // the whole note range, the instance limit is set with the heldNotes option
+#define NUM_LANES 16
+#define NOTEOFF_QUEUE_SIZE (NUM_LANES * 2)
+#define MAX_OCTAVE_SPREAD 4
 #define PLUGIN_URI "http://bramgiesen.com/arpeggiator"
 
 
-// Struct for a 3 byte MIDI event
-typedef struct {
-    LV2_Atom_Event event;
-    uint8_t        msg[3];
-} LV2_Atom_MIDI;
-
-
 typedef enum {
     MIDI_IN = 0,
     MIDI_OUT,
@@ -42,7 +57,15 @@ typedef enum {
     OCTAVESPREAD,
     OCTAVEMODE,
     VELOCITY,
-    BYPASS
+    BYPASS,
+    MULTI_LANE,
+    GATE_MODE,
+    CLOCK_GROUP,
+    NOTIFY,
+    SEED,
+    RANDOM_MODE,
+    CHORD_WINDOW,
+    CHORD_WINDOW_STEP
 } PortIndex;
 
 typedef enum {
@@ -61,61 +84,154 @@ typedef enum {
     OCTAVE_DOWN_UP
 } OctaveEnum;
 
+typedef enum {
+    GATE_HELD = 0, // high while keys are held
+    GATE_STEPS     // high while an arpeggio note sounds
+} GateEnum;
+
+typedef enum {
+    RANDOM_UNIFORM = 0,
+    RANDOM_NO_REPEAT, // never the same step twice in a row
+    RANDOM_WEIGHTED   // steps that rested longer are more likely
+} RandomEnum;
+
+// Stream of the random generator, the seed port picks the sequence within it.
+#define RANDOM_STREAM 0x41525047
+
+#define ARP_STATE_VERSION 1
+#define ARP_STATE_FREE 0xFF // free slot in a saved lane
+
+
+#define NOTE_ENDED 0xFF
+
+// Note waiting for its note-off. All pending notes share the same note
+// length, so a queue ordered by start frame is also ordered by deadline.
+typedef struct {
+    uint32_t  start; // frame the note-on was sent on
+    uint8_t   note;  // NOTE_ENDED when the note was already ended
+    uint8_t   channel;
+} PendingNote;
+
+
+// Control port values, read once at the start of every block.
+typedef struct {
+    float     bpm;
+    float     divisions;
+    float     note_length;
+    float     chord_window;      // ms
+    float     chord_window_step; // fraction of a step
+    uint8_t   arp_mode;
+    uint8_t   octave_mode;
+    uint8_t   octave_spread;
+    uint8_t   velocity;
+    uint8_t   sync;
+    uint8_t   gate_mode;
+    uint8_t   clock_group; // 0 for the own clock
+    uint8_t   random_mode;
+    uint32_t  seed;
+    bool      latch;
+    bool      enabled;
+    bool      multi_lane;
+} ArpParams;
+
+
+// Arpeggio state per lane. In multi-lane mode every MIDI channel is played
+// as its own arpeggio on the lane of the same number, otherwise everything
+// goes to lane 0. All lanes run on the same step clock, the fields are kept
+// as arrays so a step walks the same field of all lanes in one pass.
+//
+// The held notes are a set of pitches, one bit each, so holding or releasing
+// a note costs the same however many are held. Played mode also gives every
+// note a slot, a new note takes the first free one.
+typedef struct {
+    uint64_t  held[NUM_LANES][2];
+    uint64_t  slots_used[NUM_LANES][2];
+    uint8_t   slots[NUM_LANES][MAX_HELD_NOTES]; // held notes by slot
+    uint8_t   slot_of[NUM_LANES][128];  // slot of a held pitch
+    uint8_t   presses[NUM_LANES][128];  // note-ons of a held pitch that are not released yet
+    uint8_t   pattern[NUM_LANES][MAX_HELD_NOTES * 2]; // one cycle of the arpeggio
+    uint16_t  pattern_length[NUM_LANES];
+    int16_t   pattern_index[NUM_LANES]; // next step in the pattern
+    int16_t   note_played[NUM_LANES];   // pattern position of the last played note, -1 after a reset
+    uint8_t   octave_index[NUM_LANES];  // position in the octave table
+    uint8_t   note_count[NUM_LANES];    // pitches in held
+    uint16_t  notes_pressed[NUM_LANES];
+    uint32_t  played_at[NUM_LANES][MAX_HELD_NOTES * 2]; // weighted random mode, tree of the draw each pattern step last played on
+    uint32_t  draws[NUM_LANES]; // weighted random draws since the pattern was built
+    bool      pattern_dirty[NUM_LANES]; // held notes or arp mode changed since the pattern was built
+    bool      latch_playing[NUM_LANES];
+} ArpLanes;
+
 
 typedef struct {
     LV2_URID atom_Blank;
-    LV2_URID atom_Float;
     LV2_URID atom_Object;
     LV2_URID atom_Path;
     LV2_URID atom_Resource;
     LV2_URID atom_Sequence;
     LV2_URID time_Position;
-    LV2_URID time_barBeat;
-    LV2_URID time_beatsPerMinute;
-    LV2_URID time_speed;
+    LV2_URID atom_Chunk;
+    LV2_URID state; // key of the saved state
+    TransportURIs transport;
 } ClockURIs;
 
-typedef struct {
-    LV2_URID_Map*          map; // URID map feature
-    LV2_Log_Log* 	       log;
-    LV2_Log_Logger      logger; // Logger API
-    ClockURIs             uris; // Cache of mapped URIDs
-
-    // URIDs
-    LV2_URID urid_midiEvent;
 
-    const LV2_Atom_Sequence* MIDI_in;
-    LV2_Atom_Sequence*       MIDI_out;
+// What a saved session carries over: the latched notes and the walk of every
+// lane, and the random generator. Notes held by keys are left out, their
+// note-offs would never come after a reload.
+typedef struct {
+    Random    random;
+    uint32_t  seed; // the generator state only applies to the same seed
+    uint8_t   slots[NUM_LANES][MAX_HELD_NOTES]; // in played order, ARP_STATE_FREE for a free slot
+    uint8_t   slot_count[NUM_LANES]; // 0 for a lane that is not latched
+    uint8_t   octave_index[NUM_LANES];
+    int16_t   pattern_index[NUM_LANES];
+} ArpSnapshot;
+
+// The instance is laid out by how often a field is used. The state touched on
+// every processed frame comes first and fills the first two cache lines, the
+// per step and per block state follows, the setup from instantiate() is kept
+// apart at the end.
+typedef struct {
+    // per frame
+    uint32_t  pos CACHE_ALIGNED;
+    uint32_t  frame; // running frame counter, used for the note-off deadlines
+    uint32_t  note_frames; // note length in frames
+    uint32_t  first_note_at; // frame the first note of sync mode 1 or a step waiting for a chord is played on
+    bool      triggered;
+    bool      first_note;
+    uint8_t   num_lanes;
+    uint8_t   octave_table_length;
+    StepClock clock;
+    uint8_t   octave_table[MAX_OCTAVE_SPREAD * 2];
+    uint32_t  noteoff_head;
+    uint32_t  noteoff_count;
+    float*    cv_gate;
+    MidiWriter out; // writes the output events of the current block
 
-    float     divisions;
-    double    samplerate;
-    int       prev_sync;
+    // per step and per block
+    PendingNote noteoff_queue[NOTEOFF_QUEUE_SIZE] CACHE_ALIGNED;
+    ArpLanes  lanes;
+    ArpParams params; // control values of the current block
     // Variables to keep track of the tempo information sent by the host
     float     bpm; // Beats per minute (tempo)
-    uint32_t  pos;
-    uint32_t  period;
-    uint32_t  h_wavelength;
-    uint8_t   midi_notes[NUM_VOICES];
-    uint8_t   previous_midinote;
-    uint32_t  noteoff_buffer[NUM_VOICES][2];
-    size_t    active_notes_index;
-    int       note_played;
-    size_t    active_notes;
-    size_t    notes_pressed;
-    int       octave_index;
-    bool      triggered;
-    bool      octave_up;
-    bool      arp_up;
-    bool      latch_playing;
-    bool      first_note;
-    float     speed; // Transport speed (usually 0=stop, 1=play)
-    float     beat_in_measure;
-    float     previous_beat_in_measure;
-    float     previous_latch;
-    float     time_position;
-    int       previous_octave_mode;
+    Transport transport; // host position, followed in the sync modes
+    SharedClock shared_clock; // joined once a clock group is selected
+    Random    random; // draws of the random arp mode
+    PerfCounters perf; // since the last time they were published
+    uint32_t  perf_frames; // frames since the last time they were published
+    SoundingNotes sounding; // notes on at the output, played or let through
+    uint8_t   held_capacity; // most notes a lane holds, set at instantiate
+    bool      flush_pending; // deactivated, the notes are released on the next run()
+    bool      stopped; // the transport stopped while synced, the steps wait until it rolls
+    bool      chord_open; // a chord is coming in, until chord_until
+    uint32_t  chord_until; // frame the chord window closes on
+    uint32_t  state_sequence; // odd while run() changes the state
+    uint32_t  restore_flag; // hands a restore over to run()
 
-    float*    cv_gate;
+    const LV2_Atom_Sequence* MIDI_in;
+    LV2_Atom_Sequence*       MIDI_out;
+    LV2_Atom_Sequence*       notify; // optional, NULL when not connected
     float*    changeBpm;
     float*    arp_mode;
     float*    latch_mode;
@@ -126,213 +242,531 @@ typedef struct {
     float*    octaveModeParam;
     float*    velocity;
     float*    bypass;
+    float*    multi_lane;
+    float*    gate_mode;
+    float*    clock_group;
+    float*    seed;
+    float*    random_mode;
+    float*    chord_window;
+    float*    chord_window_step;
+
+    // setup
+    LV2_URID_Map*          map CACHE_ALIGNED; // URID map feature
+    LV2_Log_Log* 	       log;
+    LV2_Worker_Schedule*   schedule; // optional, joins a clock group selected while running
+    LV2_Log_Logger      logger; // Logger API
+    ClockURIs             uris; // Cache of mapped URIDs
+    PerfURIs         perf_uris;
+    LV2_Atom_Forge       forge; // writes the statistics to the notify port
+
+    // URIDs
+    LV2_URID urid_midiEvent;
+
+    double    samplerate;
+    bool      overflow_reported;
+    ArpSnapshot restore; // restored state, taken over by run()
 } Arpeggiator;
 
+LAYOUT_CHECK(LAYOUT_WITHIN_LINES(Arpeggiator, out, 2), "per frame state of the arpeggiator has to fit in two cache lines");
+LAYOUT_CHECK(offsetof(Arpeggiator, noteoff_queue) == 2 * CACHE_LINE_SIZE, "per step state of the arpeggiator has to start on the third cache line");
+
+
+static void
+placeNote(ArpLanes* lanes, int lane, uint8_t note, int slot)
+{
+    lanes->held[lane][note >> 6]       |= (uint64_t)1 << (note & 63);
+    lanes->slots_used[lane][slot >> 6] |= (uint64_t)1 << (slot & 63);
+    lanes->slots[lane][slot]            = note;
+    lanes->slot_of[lane][note]          = (uint8_t)slot;
+    lanes->presses[lane][note]          = 1;
+    lanes->note_count[lane]++;
+}
+
+
+// Adds a note to the held notes of a lane, returns true when the pitch was
+// not held yet. Notes above the capacity are not held.
+static bool
+holdNote(Arpeggiator* self, int lane, uint8_t note)
+{
+    ArpLanes*      lanes = &self->lanes;
+    uint64_t*      used  = lanes->slots_used[lane];
+    const uint64_t bit   = (uint64_t)1 << (note & 63);
+
+    if (lanes->held[lane][note >> 6] & bit) {
+        lanes->presses[lane][note] += (lanes->presses[lane][note] < UINT8_MAX);
+        return false;
+    }
+    if (lanes->note_count[lane] >= self->held_capacity) {
+        return false;
+    }
+
+    //the first free slot, there is one below the number of held notes
+    placeNote(lanes, lane, note, (~used[0]) ? __builtin_ctzll(~used[0]) : 64 + __builtin_ctzll(~used[1]));
+    return true;
+}
+
+
+// Returns true when the pitch is no longer held, a pitch that was pressed
+// more than once is held until the last of its note-offs.
+static bool
+releaseNote(Arpeggiator* self, int lane, uint8_t note)
+{
+    ArpLanes*      lanes = &self->lanes;
+    const uint64_t bit   = (uint64_t)1 << (note & 63);
+
+    if (!(lanes->held[lane][note >> 6] & bit) || --lanes->presses[lane][note] > 0) {
+        return false;
+    }
+
+    const int slot = lanes->slot_of[lane][note];
+    lanes->held[lane][note >> 6]       &= ~bit;
+    lanes->slots_used[lane][slot >> 6] &= ~((uint64_t)1 << (slot & 63));
+    lanes->note_count[lane]--;
+    return true;
+}
+
 
 static void
-swap(uint8_t *a, uint8_t *b)
+clearHeld(ArpLanes* lanes, int lane)
+{
+    memset(lanes->held[lane], 0, sizeof(lanes->held[lane]));
+    memset(lanes->slots_used[lane], 0, sizeof(lanes->slots_used[lane]));
+    memset(lanes->presses[lane], 0, sizeof(lanes->presses[lane]));
+    lanes->note_count[lane] = 0;
+}
+
+
+// Lists the entries of a set of 128 in ascending order, or the values stored
+// for them, returns how many there are.
+static int
+listSet(const uint64_t set[2], const uint8_t* values, uint8_t list[])
 {
-    int temp = *a;
-    *a = *b;
-    *b = temp;
+    int count = 0;
+
+    for (int word = 0; word < 2; word++) {
+        uint64_t bits = set[word];
+        while (bits) {
+            const int index = word * 64 + __builtin_ctzll(bits);
+            list[count++] = values ? values[index] : (uint8_t)index;
+            bits &= bits - 1;
+        }
+    }
+    return count;
 }
 
 
-//got the code for the quick sort algorithm here https://medium.com/human-in-a-machine-world/quicksort-the-best-sorting-algorithm-6ab461b5a9d0
 static void
-quicksort(uint8_t arr[], int l, int r)
+clearLane(Arpeggiator* self, int lane)
 {
-    if (l >= r)
-    {
-        return;
+    ArpLanes* lanes = &self->lanes;
+
+    clearHeld(lanes, lane);
+    lanes->pattern_index[lane] = 0;
+    lanes->note_played[lane]   = -1;
+    lanes->pattern_dirty[lane] = true;
+}
+
+
+// Forgets the notes of all lanes, also the keys that are still down.
+static void
+clearLanes(Arpeggiator* self)
+{
+    for (int lane = 0; lane < NUM_LANES; lane++) {
+        clearLane(self, lane);
+        self->lanes.notes_pressed[lane] = 0;
+        self->lanes.latch_playing[lane] = false;
     }
+}
 
-    int pivot = arr[r];
 
-    int cnt = l;
+// True when no lane besides the given one holds notes, the shared step clock
+// can then be restarted for it without cutting into another arpeggio.
+static bool
+otherLanesIdle(const Arpeggiator* self, int lane)
+{
+    for (int l = 0; l < self->num_lanes; l++) {
+        if (l != lane && self->lanes.note_count[l] > 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
 
-    for (int i = l; i <= r; i++)
-    {
-        if (arr[i] <= pivot)
-        {
-            swap(&arr[cnt], &arr[i]);
-            cnt++;
+static bool
+anyNotePressed(const Arpeggiator* self)
+{
+    for (int l = 0; l < self->num_lanes; l++) {
+        if (self->lanes.notes_pressed[l] > 0) {
+            return true;
         }
     }
-    quicksort(arr, l, cnt-2);
-    quicksort(arr, cnt, r);
+    return false;
 }
 
 
-static uint8_t
-octaveHandler(Arpeggiator* self)
+// Returns whether the pattern rises (1), falls (-1) or repeats (0) into step p.
+static int
+stepDirection(const uint8_t pattern[], int length, int p)
 {
-    uint8_t octave = 0;
+    const uint8_t previous = pattern[(p > 0) ? p - 1 : length - 1];
+
+    return (pattern[p] > previous) - (pattern[p] < previous);
+}
 
-    int octaveMode = *self->octaveModeParam;
 
-    if (octaveMode != self->previous_octave_mode) {
-        switch ((OctaveEnum)octaveMode)
-        {
-            case OCTAVE_UP:
-                self->octave_index = self->note_played % (int)*self->octaveSpreadParam;
-                break;
-            case OCTAVE_DOWN:
-                self->octave_index = self->note_played % (int)*self->octaveSpreadParam;
-                self->octave_index = (int)*self->octaveSpreadParam;
-                break;
-            case OCTAVE_UP_DOWN:
-                self->octave_index = self->note_played % (int)(*self->octaveSpreadParam * 2);
-                if (self->octave_index > (int)*self->octaveSpreadParam) {
-                    self->octave_index = abs((int)*self->octaveSpreadParam - (self->octave_index - (int)*self->octaveSpreadParam)) % (int)*self->octaveSpreadParam;
-                }
-                self->octave_up = !self->octave_up;
-                break;
-            case OCTAVE_DOWN_UP:
-                self->octave_index = (int)*self->octaveSpreadParam;
-                self->octave_up = !self->octave_up;
+// Builds one cycle of the arpeggio for the held notes and the arp mode, only
+// when one of them changed, so every step just reads the next entry.
+static void
+buildPattern(Arpeggiator* self, int lane)
+{
+    ArpLanes* lanes   = &self->lanes;
+    uint8_t*  pattern = lanes->pattern[lane];
+    uint8_t   notes[MAX_HELD_NOTES];
+    int       length  = 0;
+
+    //ascending, or in the order of the slots in played mode
+    const int count = ((ArpEnum)self->params.arp_mode != ARP_PLAYED)
+                    ? listSet(lanes->held[lane], NULL, notes)
+                    : listSet(lanes->slots_used[lane], lanes->slots[lane], notes);
+
+    //remember where the walk was before the held notes changed
+    const int     played    = lanes->note_played[lane];
+    const bool    resume    = (played >= 0);
+    const uint8_t last_note = resume ? pattern[played] : 0;
+    const int     direction = resume ? stepDirection(pattern, lanes->pattern_length[lane], played) : 0;
+
+    switch ((ArpEnum)self->params.arp_mode)
+    {
+        case ARP_DOWN:
+            for (int i = count - 1; i >= 0; i--) {
+                pattern[length++] = notes[i];
+            }
+            break;
+        case ARP_UP_DOWN:
+            for (int i = 0; i < count; i++) {
+                pattern[length++] = notes[i];
+            }
+            for (int i = count - 2; i > 0; i--) {
+                pattern[length++] = notes[i];
+            }
+            break;
+        case ARP_UP_DOWN_ALT:
+            for (int i = 0; i < count; i++) {
+                pattern[length++] = notes[i];
+            }
+            for (int i = count - 1; i >= 0; i--) {
+                pattern[length++] = notes[i];
+            }
+            break;
+        default: //up, played and random walk the notes as they are stored
+            for (int i = 0; i < count; i++) {
+                pattern[length++] = notes[i];
+            }
+            break;
+    }
+
+    //carry on after the last played note when it is still held, preferring the
+    //step that moves in the same direction so up-down keeps its way
+    int found = -1;
+    for (int p = 0; resume && p < length; p++) {
+        if (pattern[p] == last_note) {
+            found = (found < 0) ? p : found;
+            if (stepDirection(pattern, length, p) == direction) {
+                found = p;
                 break;
+            }
         }
-        self->previous_octave_mode = octaveMode;
     }
 
-    if (*self->octaveSpreadParam > 1) {
-        switch (octaveMode)
+    memset(lanes->played_at[lane], 0, length * sizeof(uint32_t));
+    lanes->draws[lane]          = 0;
+    lanes->pattern_length[lane] = length;
+    lanes->pattern_dirty[lane]  = false;
+    lanes->note_played[lane]    = found;
+    if (found >= 0) {
+        lanes->pattern_index[lane] = (found + 1 < length) ? found + 1 : 0;
+    } else {
+        lanes->pattern_index[lane] = (length > 0) ? lanes->pattern_index[lane] % length : 0;
+    }
+}
+
+
+// Builds the cycle of octave offsets the arpeggio walks through for the
+// current octave mode and spread, only when one of them changes.
+static void
+buildOctaveTable(Arpeggiator* self)
+{
+    const int spread = self->params.octave_spread;
+    uint8_t*  table  = self->octave_table;
+    int       length = 0;
+
+    if (spread <= 1) {
+        table[length++] = 0;
+    } else {
+        switch ((OctaveEnum)self->params.octave_mode)
         {
             case OCTAVE_UP:
-                octave = 12 * self->octave_index;
-                self->octave_index = (self->octave_index + 1) % (int)*self->octaveSpreadParam;
+                for (int i = 0; i < spread; i++) {
+                    table[length++] = 12 * i;
+                }
                 break;
             case OCTAVE_DOWN:
-                octave = 12 * self->octave_index;
-                self->octave_index--;
-                self->octave_index = (self->octave_index < 0) ? (int)*self->octaveSpreadParam - 1 : self->octave_index;
+                for (int i = spread - 1; i >= 0; i--) {
+                    table[length++] = 12 * i;
+                }
                 break;
             case OCTAVE_UP_DOWN:
-                octave = 12 * self->octave_index;
-
-                if (self->octave_up) {
-                    self->octave_index++;
-                    self->octave_up = (self->octave_index >= (int)*self->octaveSpreadParam - 1) ? false : true;
-                } else {
-                    self->octave_index--;
-                    self->octave_up = (self->octave_index <= 0) ? true : false;
+                for (int i = 0; i < spread; i++) {
+                    table[length++] = 12 * i;
+                }
+                for (int i = spread - 2; i > 0; i--) {
+                    table[length++] = 12 * i;
                 }
                 break;
             case OCTAVE_DOWN_UP:
-                octave = 12 * self->octave_index;
-                if (!self->octave_up) {
-                    self->octave_index--;
-                    self->octave_up = (self->octave_index <= 0) ? true : false;
-                } else {
-                    self->octave_index = (self->octave_index + 1) % (int)*self->octaveSpreadParam;
-                    self->octave_up = (self->octave_index >= (int)*self->octaveSpreadParam - 1) ? false : true;
+                for (int i = spread - 1; i >= 0; i--) {
+                    table[length++] = 12 * i;
+                }
+                for (int i = 1; i < spread - 1; i++) {
+                    table[length++] = 12 * i;
                 }
                 break;
+            default:
+                table[length++] = 0;
+                break;
         }
-    } else {
-        self->octave_index = 0;
     }
 
+    self->octave_table_length = length;
+    //keep the octave walk in line with the notes when switching mode
+    for (int l = 0; l < NUM_LANES; l++) {
+        self->lanes.octave_index[l] = self->lanes.pattern_index[l] % length;
+    }
+}
+
+
+static uint8_t
+octaveHandler(Arpeggiator* self, int lane)
+{
+    uint8_t* octave_index = &self->lanes.octave_index[lane];
+    const uint8_t octave  = self->octave_table[*octave_index];
+
+    (*octave_index)++;
+    *octave_index = (*octave_index >= self->octave_table_length) ? 0 : *octave_index;
+
     return octave;
 }
 
 
 
-static LV2_Atom_MIDI
-createMidiEvent(Arpeggiator* self, uint8_t status, uint8_t note, uint8_t velocity)
+// Returns the number of frames left until the oldest pending note has to be
+// released, 0 when it is due on the current frame.
+static uint32_t
+nextNoteOffOffset(const Arpeggiator* self, uint32_t note_length)
 {
-    LV2_Atom_MIDI msg;
-    memset(&msg, 0, sizeof(LV2_Atom_MIDI));
+    const uint32_t elapsed = self->frame - self->noteoff_queue[self->noteoff_head].start;
+
+    return (elapsed >= note_length) ? 0 : note_length - elapsed;
+}
+
 
-    msg.event.body.size = 3;
-    msg.event.body.type = self->urid_midiEvent;
 
-    msg.msg[0] = status;
-    msg.msg[1] = note;
-    msg.msg[2] = velocity;
+// A note-off is only sent for a note that is still on, a flush may already
+// have released it.
+static void
+sendNoteOff(Arpeggiator* self, const PendingNote* pending, uint32_t frame)
+{
+    if (pending->note != NOTE_ENDED && soundingOff(&self->sounding, pending->channel, pending->note)) {
+        midiWriterNote(&self->out, frame, 128 | pending->channel, pending->note, 0);
+    }
+}
 
-    return msg;
+
+// Releases every note that is on at once, there is then nothing left for the
+// pending note-offs to do.
+static void
+flushNotes(Arpeggiator* self, uint32_t frame)
+{
+    soundingFlush(&self->sounding, &self->out, frame);
+    self->noteoff_head  = 0;
+    self->noteoff_count = 0;
 }
 
 
 
 static void
-handleNoteOn(Arpeggiator* self, const uint32_t outCapacity)
+handleNoteOff(Arpeggiator* self, uint32_t frame)
 {
-    size_t searched_voices = 0;
-    bool   note_found = false;
+    while (self->noteoff_count > 0 && nextNoteOffOffset(self, self->note_frames) == 0) {
+        sendNoteOff(self, &self->noteoff_queue[self->noteoff_head], frame);
+        self->noteoff_head = (self->noteoff_head + 1) % NOTEOFF_QUEUE_SIZE;
+        self->noteoff_count--;
+    }
+}
 
-    while (!note_found && searched_voices < NUM_VOICES)
-    {
-        self->note_played = (self->note_played < 0) ? 0 : self->note_played;
 
-        if (self->midi_notes[self->note_played] > 0
-                && self->midi_notes[self->note_played] < 128)
-        {
-            uint8_t octave = octaveHandler(self);
-            uint8_t velocity = (uint8_t)*self->velocity;
-
-            //create MIDI note on message
-            uint8_t midi_note = self->midi_notes[self->note_played] + octave;
-            self->previous_midinote = midi_note;
-
-            LV2_Atom_MIDI onMsg = createMidiEvent(self, 144, midi_note, velocity);
-            lv2_atom_sequence_append_event(self->MIDI_out, outCapacity, (LV2_Atom_Event*)&onMsg);
-            self->noteoff_buffer[self->active_notes_index][0] = (uint32_t)midi_note;
-            self->active_notes_index = (self->active_notes_index + 1) % NUM_VOICES;
-            note_found = true;
-        }
-        if ((ArpEnum)*self->arp_mode == ARP_UP || ((ArpEnum)*self->arp_mode == ARP_UP_DOWN && self->active_notes < 3)
-                || (ArpEnum)*self->arp_mode == ARP_PLAYED ) {
-            self->note_played = (self->note_played + 1) % NUM_VOICES;
-        } else if ((ArpEnum)*self->arp_mode == ARP_DOWN) {
-            self->note_played--;
-            self->note_played = (self->note_played < 0) ? (int)self->active_notes : self->note_played;
-        } else if ((ArpEnum)*self->arp_mode == ARP_RANDOM) {
-            int active_div = (self->active_notes <= 0) ? 1 : (int)self->active_notes;
-            self->note_played = random() % active_div;
-        } else{
-            if (self->arp_up) {
-                self->note_played++;
-                if (self->note_played >= self->active_notes) {
-                   self->arp_up = false;
-                   if ((ArpEnum)*self->arp_mode != ARP_UP_DOWN_ALT) {
-                       self->note_played = (self->active_notes > 1) ? self->note_played - 2 : self->note_played;
-                   }
-                }
-            } else {
-                self->note_played--;
-                if ((ArpEnum)*self->arp_mode != ARP_UP_DOWN_ALT) {
-                    self->arp_up = (self->note_played <= 0) ? true : false;
-                } else {
-                    self->arp_up = (self->note_played < 0) ? true : false;
-                }
-            }
+
+static void
+queueNoteOff(Arpeggiator* self, uint8_t note, uint8_t channel, uint32_t frame)
+{
+    //queue is full, release the oldest note early instead of losing its note-off
+    if (self->noteoff_count == NOTEOFF_QUEUE_SIZE) {
+        sendNoteOff(self, &self->noteoff_queue[self->noteoff_head], frame);
+        self->noteoff_head = (self->noteoff_head + 1) % NOTEOFF_QUEUE_SIZE;
+        self->noteoff_count--;
+        if (self->notify) {
+            self->perf.notes_recovered++;
         }
-        searched_voices++;
     }
+
+    PendingNote* pending = &self->noteoff_queue[(self->noteoff_head + self->noteoff_count) % NOTEOFF_QUEUE_SIZE];
+    pending->start   = self->frame;
+    pending->note    = note;
+    pending->channel = channel;
+    self->noteoff_count++;
 }
 
 
 
+// Ends a note before it is played again, so a synth never stacks two voices
+// of one pitch. The note-off it had pending is left out.
 static void
-handleNoteOff(Arpeggiator* self, const uint32_t outCapacity)
-{
-    for (size_t i = 0; i < NUM_VOICES; i++) {
-        if (self->noteoff_buffer[i][0] > 0) {
-            self->noteoff_buffer[i][1] += 1;
-            if (self->noteoff_buffer[i][1] > (uint32_t)(self->period * *self->note_length)) {
-                LV2_Atom_MIDI offMsg = createMidiEvent(self, 128, (uint8_t)self->noteoff_buffer[i][0], 0);
-                lv2_atom_sequence_append_event(self->MIDI_out, outCapacity, (LV2_Atom_Event*)&offMsg);
-                self->noteoff_buffer[i][0] = 0;
-                self->noteoff_buffer[i][1] = 0;
+endSoundingNote(Arpeggiator* self, uint8_t note, uint8_t channel, uint32_t frame)
+{
+    if (!soundingOff(&self->sounding, channel, note)) {
+        return;
+    }
+    midiWriterNote(&self->out, frame, 128 | channel, note, 0);
+
+    for (uint32_t i = 0; i < self->noteoff_count; i++) {
+        PendingNote* pending = &self->noteoff_queue[(self->noteoff_head + i) % NOTEOFF_QUEUE_SIZE];
+        if (pending->note == note && pending->channel == channel) {
+            pending->note = NOTE_ENDED;
+            break;
+        }
+    }
+}
+
+
+// Sum of the first count entries of a played_at tree. Node k (from 1) is kept
+// in tree[k - 1] and holds the entries after k minus its lowest bit up to k.
+static uint32_t
+playedAtSum(const uint32_t* tree, int count)
+{
+    uint32_t sum = 0;
+    for (int k = count; k > 0; k -= k & -k) {
+        sum += tree[k - 1];
+    }
+    return sum;
+}
+
+
+// Weighted random step: a step that last played on draw d weighs now - d, so
+// it gains one for every step it rests and weighs one right after it played.
+// All weights grow each draw, the tree keeps d instead so a draw costs a walk
+// down the tree rather than one over the whole pattern. The sums wrap along
+// with now, the differences stay exact.
+static int
+weightedStep(uint32_t* tree, uint32_t now, int length, Random* random)
+{
+    uint32_t pick = randomBelow(random, (uint32_t)length * now - playedAtSum(tree, length));
+
+    //walk down to the step the pick falls in, a node weighs its size times now minus its sum
+    int top = 1;
+    while (top * 2 <= length) {
+        top *= 2;
+    }
+    int step = 0;
+    for (int size = top; size > 0; size >>= 1) {
+        if (step + size <= length) {
+            const uint32_t weight = (uint32_t)size * now - tree[step + size - 1];
+            if (pick >= weight) {
+                pick -= weight;
+                step += size;
             }
         }
     }
+
+    //it plays on this draw
+    const uint32_t played = playedAtSum(tree, step + 1) - playedAtSum(tree, step);
+    for (int k = step + 1; k <= length; k += k & -k) {
+        tree[k - 1] += now - played;
+    }
+    return step;
 }
 
 
+// Draws the next step of the random mode from the pattern of a lane, which
+// holds exactly the held notes.
+static int
+randomStep(Arpeggiator* self, int lane, int length)
+{
+    ArpLanes* lanes = &self->lanes;
+    const int last  = lanes->note_played[lane];
+
+    switch ((RandomEnum)self->params.random_mode)
+    {
+        case RANDOM_NO_REPEAT:
+            if (length > 1 && last >= 0) {
+                //leave the last step out of the draw
+                const int step = (int)randomBelow(&self->random, (uint32_t)length - 1);
+                return (step >= last) ? step + 1 : step;
+            }
+            break;
+        case RANDOM_WEIGHTED:
+            return weightedStep(lanes->played_at[lane], ++lanes->draws[lane], length, &self->random);
+        default:
+            break;
+    }
+    return (int)randomBelow(&self->random, (uint32_t)length);
+}
+
+
+
+// Plays the next step of one lane, on the MIDI channel of the lane.
+static void
+playStep(Arpeggiator* self, int lane, uint32_t frame)
+{
+    ArpLanes* lanes = &self->lanes;
+
+    if (lanes->pattern_dirty[lane]) {
+        buildPattern(self, lane);
+    }
+    const int length = lanes->pattern_length[lane];
+    if (length == 0) {
+        return;
+    }
+
+    if ((ArpEnum)self->params.arp_mode == ARP_RANDOM) {
+        lanes->pattern_index[lane] = randomStep(self, lane, length);
+    }
+    const int index = lanes->pattern_index[lane];
+
+    //create MIDI note on message
+    const uint8_t octave    = octaveHandler(self, lane);
+    const uint8_t midi_note = lanes->pattern[lane][index] + octave;
+
+    endSoundingNote(self, midi_note, lane, frame);
+    midiWriterNote(&self->out, frame, 144 | lane, midi_note, self->params.velocity);
+    soundingOn(&self->sounding, lane, midi_note);
+    queueNoteOff(self, midi_note, lane, frame);
+
+    lanes->note_played[lane]   = index;
+    lanes->pattern_index[lane] = (index + 1 < length) ? index + 1 : 0;
+}
+
+
+static void
+handleNoteOn(Arpeggiator* self, uint32_t frame)
+{
+    for (int lane = 0; lane < self->num_lanes; lane++) {
+        playStep(self, lane, frame);
+    }
+}
+
+
+
 static void
 connect_port(LV2_Handle instance,
         uint32_t   port,
@@ -380,6 +814,30 @@ connect_port(LV2_Handle instance,
         case BYPASS:
             self->bypass = (float*)data;
             break;
+        case MULTI_LANE:
+            self->multi_lane = (float*)data;
+            break;
+        case GATE_MODE:
+            self->gate_mode = (float*)data;
+            break;
+        case CLOCK_GROUP:
+            self->clock_group = (float*)data;
+            break;
+        case NOTIFY:
+            self->notify = (LV2_Atom_Sequence*)data;
+            break;
+        case SEED:
+            self->seed = (float*)data;
+            break;
+        case RANDOM_MODE:
+            self->random_mode = (float*)data;
+            break;
+        case CHORD_WINDOW:
+            self->chord_window = (float*)data;
+            break;
+        case CHORD_WINDOW_STEP:
+            self->chord_window_step = (float*)data;
+            break;
     }
 }
 
@@ -391,8 +849,17 @@ activate(LV2_Handle instance)
     Arpeggiator* self = (Arpeggiator*)instance;
 
     self->bpm = *self->changeBpm;
-    self->divisions =*self->changedDiv;
+    self->params.divisions = *self->changedDiv;
     self->pos = 0;
+
+    //a render starts from the seed
+    self->params.seed = (uint32_t)*self->seed;
+    randomSeed(&self->random, self->params.seed, RANDOM_STREAM);
+
+    //a group selected before the start is joined here, off the audio thread
+    if (*self->clock_group >= 1 && *self->clock_group <= SHARED_CLOCK_GROUPS) {
+        sharedClockJoin(&self->shared_clock);
+    }
 }
 
 
@@ -403,12 +870,14 @@ instantiate(const LV2_Descriptor*     descriptor,
         const char*               bundle_path,
         const LV2_Feature* const* features)
 {
-    Arpeggiator* self = (Arpeggiator*)calloc(1, sizeof(Arpeggiator));
+    Arpeggiator* self = (Arpeggiator*)alignedInstance(sizeof(Arpeggiator));
     if (!self)
     {
         return NULL;
     }
 
+    const LV2_Options_Option* options = NULL;
+
     for (uint32_t i=0; features[i]; ++i)
     {
         if (!strcmp (features[i]->URI, LV2_URID__map))
@@ -419,13 +888,21 @@ instantiate(const LV2_Descriptor*     descriptor,
         {
             self->log = (LV2_Log_Log*)features[i]->data;
         }
+        else if (!strcmp (features[i]->URI, LV2_WORKER__schedule))
+        {
+            self->schedule = (LV2_Worker_Schedule*)features[i]->data;
+        }
+        else if (!strcmp (features[i]->URI, LV2_OPTIONS__options))
+        {
+            options = (const LV2_Options_Option*)features[i]->data;
+        }
     }
 
     lv2_log_logger_init (&self->logger, self->map, self->log);
 
     if (!self->map) {
         lv2_log_error (&self->logger, "arpeggiator.lv2 error: Host does not support urid:map\n");
-        free (self);
+        alignedInstanceFree(self);
         return NULL;
     }
 
@@ -434,42 +911,43 @@ instantiate(const LV2_Descriptor*     descriptor,
     LV2_URID_Map* const map   = self->map;
     self->urid_midiEvent      = map->map(map->handle, LV2_MIDI__MidiEvent);
     uris->atom_Blank          = map->map(map->handle, LV2_ATOM__Blank);
-    uris->atom_Float          = map->map(map->handle, LV2_ATOM__Float);
     uris->atom_Object         = map->map(map->handle, LV2_ATOM__Object);
     uris->atom_Path           = map->map(map->handle, LV2_ATOM__Path);
     uris->atom_Resource       = map->map(map->handle, LV2_ATOM__Resource);
     uris->atom_Sequence       = map->map(map->handle, LV2_ATOM__Sequence);
     uris->time_Position       = map->map(map->handle, LV2_TIME__Position);
-    uris->time_barBeat        = map->map(map->handle, LV2_TIME__barBeat);
-    uris->time_beatsPerMinute = map->map(map->handle, LV2_TIME__beatsPerMinute);
-    uris->time_speed          = map->map(map->handle, LV2_TIME__speed);
+    uris->atom_Chunk          = map->map(map->handle, LV2_ATOM__Chunk);
+    uris->state               = map->map(map->handle, PLUGIN_URI "#state");
+    transportMapURIs(&uris->transport, map);
+    perfMapURIs(&self->perf_uris, map, PLUGIN_URI);
+    lv2_atom_forge_init(&self->forge, map);
+
+    //the host can limit the held notes per lane, the default is the whole note range
+    self->held_capacity = MAX_HELD_NOTES;
+    const LV2_URID held_notes = map->map(map->handle, PLUGIN_URI "#heldNotes");
+    const LV2_URID atom_Int   = map->map(map->handle, LV2_ATOM__Int);
+    for (const LV2_Options_Option* o = options; o && o->key; o++) {
+        if (o->key == held_notes && o->type == atom_Int) {
+            const int32_t capacity = *(const int32_t*)o->value;
+            self->held_capacity = (capacity < 1) ? 1 : (capacity > MAX_HELD_NOTES) ? MAX_HELD_NOTES : (uint8_t)capacity;
+        }
+    }
 
     debug_print("DEBUGING");
     self->samplerate = rate;
-    self->prev_sync   = 0;
-    self->beat_in_measure = 0.0;
-    self->previous_beat_in_measure = 0.0;
+    transportInit(&self->transport, rate);
+    perfReset(&self->perf);
+    randomSeed(&self->random, 0, RANDOM_STREAM);
     self->triggered = false;
-    self->octave_up = false;
-    self->arp_up    = true;
-    self->active_notes_index = 0;
-    self->note_played = 0;
-    self->active_notes = 0;
-    self->previous_octave_mode = 0;
-    self->octave_index = 0;
-    self->previous_latch = 0;
-    self->previous_midinote = 0;
-    self->notes_pressed = 0;
-    self->latch_playing = false;
+    self->noteoff_head = 0;
+    self->noteoff_count = 0;
+    self->frame = 0;
+    self->num_lanes = 1;
     self->first_note = false;
+    self->chord_open = false;
 
-    for (unsigned i = 0; i < NUM_VOICES; i++) {
-        self->midi_notes[i] = 200;
-    }
-    for (unsigned i = 0; i < NUM_VOICES; i++) {
-        for (unsigned x = 0; x < 2; x++) {
-            self->noteoff_buffer[i][x] = 0;
-        }
+    for (int lane = 0; lane < NUM_LANES; lane++) {
+        clearLane(self, lane);
     }
 
     return (LV2_Handle)self;
@@ -478,231 +956,836 @@ instantiate(const LV2_Descriptor*     descriptor,
 
 
 
-static void
+// Applies a transport position on the current frame, returns true when the
+// step clock has to be lined up with the host again.
+static bool
 update_position(Arpeggiator* self, const LV2_Atom_Object* obj)
 {
-    const ClockURIs* uris = &self->uris;
+    TransportUpdate update;
 
     // Received new transport position/speed
-    LV2_Atom *beat = NULL, *bpm = NULL, *speed = NULL;
-    lv2_atom_object_get(obj,
-            uris->time_barBeat, &beat,
-            uris->time_beatsPerMinute, &bpm,
-            uris->time_speed, &speed,
-            NULL);
-    if (bpm && bpm->type == uris->atom_Float)
-    {
-        // Tempo changed, update BPM
-        self->bpm = ((LV2_Atom_Float*)bpm)->body;
-    }
-    if (speed && speed->type == uris->atom_Float)
-    {
-        // Speed changed, e.g. 0 (stop) to 1 (play)
-        self->speed = ((LV2_Atom_Float*)speed)->body;
-    }
-    if (beat && beat->type == uris->atom_Float)
-    {
-        // Received a beat position, synchronise
-        self->beat_in_measure = ((LV2_Atom_Float*)beat)->body;
-    }
+    transportParse(&self->uris.transport, obj, &update);
+
+    return transportApply(&self->transport, self->frame, &update);
 }
 
 
 
-static uint32_t
-resetPhase(Arpeggiator* self)
+static float
+currentBpm(const Arpeggiator* self)
 {
-    uint32_t pos = (uint32_t)fmod(self->samplerate * (60.0f / self->bpm) * self->beat_in_measure, (self->samplerate * (60.0f / (self->bpm * (self->divisions / 2.0f)))));
-
-    return pos;
+    //map bpm to host or to bpm parameter
+    if (self->params.sync == 0 || self->transport.bpm <= 0) {
+        return self->params.bpm;
+    }
+    return transportQuarterBpm(&self->transport);
 }
 
 
 static void
-run(LV2_Handle instance, uint32_t n_samples)
+updateTempo(Arpeggiator* self, bool new_length)
 {
-    Arpeggiator* self = (Arpeggiator*)instance;
-    const ClockURIs* uris = &self->uris;
+    //the step length is only recomputed when tempo or divisions changed
+    if (stepClockUpdate(&self->clock, self->samplerate, self->bpm, self->params.divisions) || new_length) {
+        self->note_frames = (uint32_t)((self->clock.step_length >> 32) * self->params.note_length);
+    }
+}
 
-    float current_beat_pos = self->beat_in_measure;
 
-    self->MIDI_out->atom.type = self->MIDI_in->atom.type;
-    const uint32_t out_capacity = self->MIDI_out->atom.size;
+static uint32_t
+resetPhase(Arpeggiator* self)
+{
+    return stepClockPhase(&self->clock, transportQuarterBeat(&self->transport, self->frame));
+}
 
-    // Write an empty Sequence header to the output
-    lv2_atom_sequence_clear(self->MIDI_out);
 
-    // Read incoming events
-    LV2_ATOM_SEQUENCE_FOREACH(self->MIDI_in, ev)
-    {
-        size_t search_note;
-        if (ev->body.type == uris->atom_Object ||
-                ev->body.type == uris->atom_Blank) {
-            const LV2_Atom_Object* obj = (const LV2_Atom_Object*)&ev->body;
-            if (obj->body.otype == uris->time_Position) {
-                update_position(self, obj);
+// Lines the steps up with the host grid on the current frame. A step is only
+// played right away when this lands exactly on its start.
+static void
+lockToHost(Arpeggiator* self)
+{
+    self->bpm = currentBpm(self);
+    updateTempo(self, false);
+    self->pos = resetPhase(self);
+    self->triggered = (self->pos != 0);
+}
+
+
+// The gate is rendered as spans of a constant value, filled four samples at
+// a time on CPUs with vector registers.
+static void
+fillGate(float* gate, uint32_t n_samples, float value)
+{
+    uint32_t i = 0;
+
+#if defined(__SSE__)
+    //scalar until the output is aligned for the vector stores
+    for (; i < n_samples && ((uintptr_t)&gate[i] & 15) != 0; i++) {
+        gate[i] = value;
+    }
+    const __m128 v = _mm_set1_ps(value);
+    for (; i + 4 <= n_samples; i += 4) {
+        _mm_store_ps(&gate[i], v);
+    }
+#elif defined(__ARM_NEON)
+    const float32x4_t v = vdupq_n_f32(value);
+    for (; i + 4 <= n_samples; i += 4) {
+        vst1q_f32(&gate[i], v);
+    }
+#endif
+    for (; i < n_samples; i++) {
+        gate[i] = value;
+    }
+}
+
+
+// True when a step would not play anything on any lane. A lane with a
+// pending rebuild is not silent yet, the rebuild also resets its walk.
+static bool
+lanesSilent(const Arpeggiator* self)
+{
+    for (int lane = 0; lane < self->num_lanes; lane++) {
+        if (self->lanes.pattern_length[lane] > 0 || self->lanes.pattern_dirty[lane]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+
+// Returns the number of frames from the current position on in which nothing
+// else happens than the phase moving forward.
+static uint32_t
+nextEventOffset(const Arpeggiator* self, uint32_t remaining)
+{
+    if (self->pos >= self->clock.period) {
+        return 0;
+    }
+
+    //next step boundary
+    uint32_t offset = self->clock.period - self->pos;
+
+    //or the end of the chord window of a first note
+    if (self->first_note) {
+        const int32_t wait = (int32_t)(self->first_note_at - self->frame);
+        if (wait <= 0) {
+            return 0;
+        }
+        offset = ((uint32_t)wait < offset) ? (uint32_t)wait : offset;
+    }
+
+    if (!self->triggered) {
+        if (self->pos < self->clock.h_wavelength) {
+            return 0;
+        }
+    } else {
+        if (self->pos > self->clock.h_wavelength) {
+            return 0;
+        }
+        //frame where the trigger is released
+        offset = (self->clock.h_wavelength + 1 - self->pos < offset) ? self->clock.h_wavelength + 1 - self->pos : offset;
+    }
+
+    //next note-off
+    if (self->noteoff_count > 0) {
+        const uint32_t note_off = nextNoteOffOffset(self, self->note_frames);
+        offset = (note_off < offset) ? note_off : offset;
+    }
+
+    return (offset < remaining) ? offset : remaining;
+}
+
+
+
+static void
+skipFrames(Arpeggiator* self, uint32_t frames)
+{
+    self->pos += frames;
+    self->frame += frames;
+}
+
+
+
+// The frame loop is written once, in processFrameFor() and runFramesFor(),
+// and compiled into a variant for every combination of the settings it would
+// otherwise look at on every processed frame. The flags are constants in each
+// variant, so the branches on them and the loops over unused lanes drop out.
+#define ARP_ALWAYS_INLINE static inline __attribute__((always_inline))
+
+
+ARP_ALWAYS_INLINE void
+processFrameFor(Arpeggiator* self, uint32_t frame, bool silent, bool multi_lane)
+{
+    //a new step starts on this very frame, so a step lasts exactly one period
+    if(self->pos >= self->clock.period) {
+        self->pos = 0;
+        stepClockNextStep(&self->clock);
+    }
+    //the notes that end on this frame go first, a step that plays the same
+    //pitch again would otherwise be cut by the note-off of the one before
+    handleNoteOff(self, frame);
+    if((self->pos < self->clock.h_wavelength && !self->triggered)
+            || (self->first_note && (int32_t)(self->frame - self->first_note_at) >= 0)) {
+        if (self->chord_open && (int32_t)(self->frame - self->chord_until) < 0) {
+            if (self->params.sync == 0) {
+                //a chord is still coming in, the step plays when its window closes
+                self->first_note = true;
+                self->first_note_at = self->chord_until;
+            }
+            //in the sync modes the step stays on the grid, it is skipped and
+            //the next one plays the whole chord
+        } else {
+            //trigger MIDI message
+            if (!silent) {
+                if (multi_lane) {
+                    handleNoteOn(self, frame);
+                } else {
+                    playStep(self, 0, frame);
+                }
             }
+            self->first_note = false;
+            self->chord_open = false;
         }
-        else if (ev->body.type == self->urid_midiEvent)
+        self->triggered = true;
+    } else if (self->pos > self->clock.h_wavelength) {
+        //set gate
+        self->triggered = false;
+    }
+    self->pos += 1;
+    self->frame += 1;
+}
+
+
+
+// Frames a new arpeggio waits for the rest of its chord, the notes of a chord
+// rarely arrive on the same frame. The larger of the two windows, and always
+// less than a step.
+static uint32_t
+chordWindow(const Arpeggiator* self)
+{
+    const double by_time = self->params.chord_window * self->samplerate / 1000.0;
+    const double by_step = self->params.chord_window_step * self->clock.period;
+    const double window  = (by_time > by_step) ? by_time : by_step;
+
+    if (window <= 0 || self->clock.period <= 1) {
+        return 0;
+    }
+    return (window < self->clock.period) ? (uint32_t)window : self->clock.period - 1;
+}
+
+
+// The first note-on of a chord opens the window, the notes that follow within
+// it fall in the same one. A step that comes due while it is open waits until
+// it closes, so a new arpeggio, a legato chord change and a chord on another
+// lane all start from the whole chord. In the sync modes the steps stay on
+// the host grid, so such a step is skipped instead.
+static void
+openChordWindow(Arpeggiator* self)
+{
+    if (self->chord_open && (int32_t)(self->frame - self->chord_until) < 0) {
+        return;
+    }
+    const uint32_t window = chordWindow(self);
+    self->chord_open  = (window > 0);
+    self->chord_until = self->frame + window;
+}
+
+
+
+// Called on the frame the event arrives on. A note is held from that frame
+// on, so a step that started before it plays without it, even when both fall
+// in the same block; the walk then carries on after the note that played.
+static void
+processMidiEvent(Arpeggiator* self, const LV2_Atom_Event* ev)
+{
+    const uint8_t* const msg = (const uint8_t*)(ev + 1);
+
+    const uint8_t status = msg[0] & 0xF0;
+
+    if (self->params.enabled) {
+
+        ArpLanes* lanes     = &self->lanes;
+        const int lane      = self->params.multi_lane ? (msg[0] & 0x0F) : 0;
+        uint8_t   midi_note = msg[1] & 0x7F;
+
+        //a note-on with velocity 0 releases the note, as in the bypass below
+        const uint8_t kind = (status == LV2_MIDI_MSG_NOTE_ON && msg[2] == 0) ? LV2_MIDI_MSG_NOTE_OFF : status;
+
+        switch (kind)
         {
-            const uint8_t* const msg = (const uint8_t*)(ev + 1);
-
-            const uint8_t status = msg[0] & 0xF0;
-
-            if (*self->bypass == 1) {
-
-                uint8_t midi_note = msg[1];
-                uint8_t note_to_find;
-                size_t find_free_voice;
-                bool voice_found;
-
-                switch (status)
-                {
-                    case LV2_MIDI_MSG_NOTE_ON:
-                        if (self->notes_pressed == 0) {
-                            if (!self->latch_playing) { //TODO check if there needs to be an exception when using sync
-                                if (*self->sync == 0) {
-                                    self->pos = 0;
-                                }
-                                self->octave_index = 0;
-                                self->note_played = 0;
+            case LV2_MIDI_MSG_NOTE_ON:
+                openChordWindow(self);
+                if (lanes->notes_pressed[lane] == 0) {
+                    //the step clock is shared, only restart it when no other lane is playing
+                    const bool restart = otherLanesIdle(self, lane);
+                    //the first step of a new arpeggio waits for the rest of the chord
+                    const uint32_t window = (restart && self->chord_open) ? self->chord_until - self->frame : 0;
+                    if (!lanes->latch_playing[lane]) { //TODO check if there needs to be an exception when using sync
+                        if (restart) {
+                            if (self->params.sync == 0) {
+                                //the step starts when the window is over
+                                self->pos = (window > 0) ? self->clock.period - window : 0;
+                                self->triggered = (window > 0);
+                            } else {
+                                //the grid stays, a step due in the window is skipped
                                 self->triggered = false;
                             }
-                            if (*self->latch_mode == 1) {
-                                self->latch_playing = true;
-                                self->active_notes = 0;
-                                for (unsigned i = 0; i < NUM_VOICES; i++) {
-                                    self->midi_notes[i] = 200;
-                                }
-                            }
-                            if (*self->sync == 1 && !self->latch_playing) {
-                                self->first_note = true;
-                            }
-                        }
-                        self->notes_pressed++;
-                        self->active_notes++;
-                        find_free_voice = 0;
-                        voice_found = false;
-                        while (find_free_voice < NUM_VOICES && !voice_found)
-                        {
-                            if (self->midi_notes[find_free_voice] == 200) {
-                                self->midi_notes[find_free_voice] = midi_note;
-                                voice_found = true;
-                            }
-                            find_free_voice++;
-                        }
-                        if ((ArpEnum)*self->arp_mode != ARP_PLAYED)
-                            quicksort(self->midi_notes, 0, NUM_VOICES - 1);
-                        if (midi_note < self->midi_notes[self->note_played - 1] &&
-                                self->note_played > 0) {
-                            self->note_played++;
-                        }
-                        break;
-                    case LV2_MIDI_MSG_NOTE_OFF:
-                        self->notes_pressed--;
-                        if (!self->latch_playing)
-                            self->active_notes = self->notes_pressed;
-                        note_to_find = midi_note;
-                        search_note = 0;
-                        if (*self->latch_mode == 0) {
-                            self->latch_playing = false;
-                            while (search_note < NUM_VOICES)
-                            {
-                                if (self->midi_notes[search_note] == note_to_find)
-                                {
-                                    self->midi_notes[search_note] = 200;
-                                    search_note = NUM_VOICES;
-                                }
-                                search_note++;
-                            }
-                            if ((ArpEnum)*self->arp_mode != ARP_PLAYED)
-                                quicksort(self->midi_notes, 0, NUM_VOICES - 1);
                         }
-                        break;
-                    default:
-                        break;
+                        lanes->octave_index[lane] = 0;
+                        lanes->pattern_index[lane] = 0;
+                        lanes->note_played[lane] = -1;
+                    }
+                    if (self->params.latch) {
+                        lanes->latch_playing[lane] = true;
+                        clearHeld(lanes, lane);
+                    }
+                    if (self->params.sync == 1 && !lanes->latch_playing[lane] && restart) {
+                        self->first_note = true;
+                        self->first_note_at = self->frame + window;
+                    }
                 }
-            }
-            else {
-                //send MIDI message through
-                lv2_atom_sequence_append_event(self->MIDI_out, out_capacity, ev);
+                lanes->notes_pressed[lane]++;
+                holdNote(self, lane, midi_note);
+                lanes->pattern_dirty[lane] = true;
+                break;
+            case LV2_MIDI_MSG_NOTE_OFF:
+                if (lanes->notes_pressed[lane] > 0) {
+                    lanes->notes_pressed[lane]--;
+                }
+                if (!self->params.latch) {
+                    lanes->latch_playing[lane] = false;
+                    releaseNote(self, lane, midi_note);
+                    lanes->pattern_dirty[lane] = true;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+    else {
+        //send MIDI message through, keep track of the notes it leaves on so
+        //they can be released when the arpeggiator takes over again
+        if (status == LV2_MIDI_MSG_NOTE_ON && msg[2] > 0) {
+            soundingOn(&self->sounding, msg[0] & 0x0F, msg[1]);
+        } else if (status == LV2_MIDI_MSG_NOTE_ON || status == LV2_MIDI_MSG_NOTE_OFF) {
+            soundingOff(&self->sounding, msg[0] & 0x0F, msg[1]);
+        }
+        midiWriterForward(&self->out, ev);
+    }
+}
+
+
+
+ARP_ALWAYS_INLINE void
+runFramesFor(Arpeggiator* self, uint32_t start, uint32_t end, bool silent, bool multi_lane, bool steps_gate)
+{
+    //the held notes only change on events, so with that gate the whole span
+    //has one value, the steps gate is written as one span per value
+    const bool pressed  = multi_lane ? anyNotePressed(self) : self->lanes.notes_pressed[0] > 0;
+    uint32_t gate_start = start;
+    float    gate       = (steps_gate ? self->noteoff_count > 0 : pressed) ? 1.0f : 0.0f;
+
+    //jump from one step boundary or note-off to the next instead of stepping every sample
+    uint32_t i = start;
+    while (i < end) {
+        const uint32_t idle_frames = nextEventOffset(self, end - i);
+
+        if (idle_frames > 0) {
+            skipFrames(self, idle_frames);
+            i += idle_frames;
+        } else {
+            processFrameFor(self, i, silent, multi_lane);
 
+            const float value = (self->noteoff_count > 0) ? 1.0f : 0.0f;
+            if (steps_gate && value != gate) {
+                fillGate(&self->cv_gate[gate_start], i - gate_start, gate);
+                gate_start = i;
+                gate = value;
             }
+            i++;
         }
     }
+    fillGate(&self->cv_gate[gate_start], end - gate_start, gate);
+}
+
+
+#define ARP_RUN_FRAMES_VARIANT(name, silent, multi_lane, steps_gate) \
+    static void name(Arpeggiator* self, uint32_t start, uint32_t end) \
+    { runFramesFor(self, start, end, silent, multi_lane, steps_gate); }
+
+ARP_RUN_FRAMES_VARIANT(runFramesHeld,            false, false, false)
+ARP_RUN_FRAMES_VARIANT(runFramesSteps,           false, false, true)
+ARP_RUN_FRAMES_VARIANT(runFramesLanesHeld,       false, true,  false)
+ARP_RUN_FRAMES_VARIANT(runFramesLanesSteps,      false, true,  true)
+ARP_RUN_FRAMES_VARIANT(runFramesSilentHeld,      true,  false, false)
+ARP_RUN_FRAMES_VARIANT(runFramesSilentSteps,     true,  false, true)
+ARP_RUN_FRAMES_VARIANT(runFramesSilentLanesHeld, true,  true,  false)
+ARP_RUN_FRAMES_VARIANT(runFramesSilentLanesSteps,true,  true,  true)
+
+
+// In the sync modes the steps wait once the host transport stopped, the
+// position stays where it stopped until lockToHost() puts it back on the
+// grid when the transport rolls again. The notes were cut when it stopped.
+// A transport that was never rolling does not hold the steps, they follow
+// the host tempo as before.
+static void
+runFramesStopped(Arpeggiator* self, uint32_t start, uint32_t end)
+{
+    const bool  pressed = (self->num_lanes > 1) ? anyNotePressed(self) : self->lanes.notes_pressed[0] > 0;
+    const float gate    = ((GateEnum)self->params.gate_mode == GATE_STEPS ? self->noteoff_count > 0 : pressed) ? 1.0f : 0.0f;
+
+    fillGate(&self->cv_gate[start], end - start, gate);
+    self->frame += end - start;
+}
+
+
+// Runs the frames up to the next event with the variant for the current
+// settings. Whether the lanes are silent can only change on an event, so it
+// is decided per span, the rest once per block.
+static void
+runFrames(Arpeggiator* self, uint32_t start, uint32_t end)
+{
+    if (self->params.sync > 0 && self->stopped) {
+        runFramesStopped(self, start, end);
+        return;
+    }
+
+    typedef void (*RunFramesFn)(Arpeggiator*, uint32_t, uint32_t);
+    static const RunFramesFn variants[8] = {
+        runFramesHeld,       runFramesSteps,       runFramesLanesHeld,       runFramesLanesSteps,
+        runFramesSilentHeld, runFramesSilentSteps, runFramesSilentLanesHeld, runFramesSilentLanesSteps,
+    };
+    const unsigned variant = (lanesSilent(self) ? 4 : 0)
+                           | (self->num_lanes > 1 ? 2 : 0)
+                           | ((GateEnum)self->params.gate_mode == GATE_STEPS ? 1 : 0);
 
-    if (*self->latch_mode == 0 && self->previous_latch == 1 && self->notes_pressed <= 0) {
-        for (unsigned i = 0; i < NUM_VOICES; i++) {
-            self->midi_notes[i] = 200;
-            self->note_played = 0;
+    variants[variant](self, start, end);
+}
+
+
+static void
+readParams(const Arpeggiator* self, ArpParams* params)
+{
+    params->bpm           = *self->changeBpm;
+    params->divisions     = *self->changedDiv;
+    params->note_length   = *self->note_length;
+    params->arp_mode      = (uint8_t)*self->arp_mode;
+    params->octave_mode   = (uint8_t)*self->octaveModeParam;
+    params->octave_spread = (uint8_t)*self->octaveSpreadParam;
+    params->octave_spread = (params->octave_spread < 1) ? 1 : (params->octave_spread > MAX_OCTAVE_SPREAD) ? MAX_OCTAVE_SPREAD : params->octave_spread;
+    params->velocity      = (uint8_t)*self->velocity;
+    params->sync          = (uint8_t)*self->sync;
+    params->latch         = (*self->latch_mode > 0.5f);
+    params->enabled       = (*self->bypass > 0.5f);
+    params->multi_lane    = (*self->multi_lane > 0.5f);
+    params->gate_mode     = (uint8_t)*self->gate_mode;
+    params->clock_group   = (uint8_t)*self->clock_group;
+    params->clock_group   = (params->clock_group > SHARED_CLOCK_GROUPS) ? 0 : params->clock_group;
+    params->random_mode   = (uint8_t)*self->random_mode;
+    params->seed          = (uint32_t)*self->seed;
+    params->chord_window      = *self->chord_window;
+    params->chord_window_step = *self->chord_window_step;
+}
+
+
+
+// Reads the latched notes and walk of every lane and the random generator.
+static void
+takeSnapshot(const void* instance, void* snapshot_out)
+{
+    const Arpeggiator* self     = (const Arpeggiator*)instance;
+    const ArpLanes*    lanes    = &self->lanes;
+    ArpSnapshot*       snapshot = (ArpSnapshot*)snapshot_out;
+
+    snapshot->random = self->random;
+    snapshot->seed   = self->params.seed;
+
+    for (int lane = 0; lane < NUM_LANES; lane++) {
+        const uint64_t* used = lanes->slots_used[lane];
+        int count = 0;
+
+        if (lanes->latch_playing[lane]) {
+            //up to the last slot in use, the free ones before it are kept
+            count = used[1] ? 128 - __builtin_clzll(used[1]) : used[0] ? 64 - __builtin_clzll(used[0]) : 0;
+        }
+        for (int slot = 0; slot < count; slot++) {
+            const bool in_use = (used[slot >> 6] >> (slot & 63)) & 1;
+            snapshot->slots[lane][slot] = in_use ? lanes->slots[lane][slot] : ARP_STATE_FREE;
         }
+        snapshot->slot_count[lane]    = (uint8_t)count;
+        snapshot->octave_index[lane]  = lanes->octave_index[lane];
+        snapshot->pattern_index[lane] = lanes->pattern_index[lane];
     }
-    if (*self->latch_mode != self->previous_latch) {
-        self->previous_latch = *self->latch_mode;
+}
+
+
+static void
+writeSnapshot(const void* snapshot_in, StateBlob* blob)
+{
+    const ArpSnapshot* snapshot = (const ArpSnapshot*)snapshot_in;
+
+    stateWrite(blob, ARP_STATE_VERSION, 1);
+    stateWrite(blob, snapshot->seed, 4);
+    stateWrite(blob, snapshot->random.state, 8);
+    stateWrite(blob, snapshot->random.inc, 8);
+
+    for (int lane = 0; lane < NUM_LANES; lane++) {
+        stateWrite(blob, snapshot->slot_count[lane], 1);
+        stateWrite(blob, snapshot->octave_index[lane], 1);
+        stateWrite(blob, (uint16_t)snapshot->pattern_index[lane], 2);
+        for (int slot = 0; slot < snapshot->slot_count[lane]; slot++) {
+            stateWrite(blob, snapshot->slots[lane][slot], 1);
+        }
     }
+}
 
-    for(uint32_t i = 0; i < n_samples; i ++) {
-        //map bpm to host or to bpm parameter
-        if (*self->sync == 0) {
-            self->bpm = *self->changeBpm;
-        } else {
-            self->bpm = self->bpm;
+
+// Returns false when the saved state is not one this version understands.
+static bool
+readSnapshot(void* snapshot_out, StateBlob* blob)
+{
+    ArpSnapshot* snapshot = (ArpSnapshot*)snapshot_out;
+
+    if (stateRead(blob, 1) != ARP_STATE_VERSION) {
+        return false;
+    }
+    snapshot->seed         = (uint32_t)stateRead(blob, 4);
+    snapshot->random.state = stateRead(blob, 8);
+    snapshot->random.inc   = stateRead(blob, 8) | 1u;
+
+    for (int lane = 0; lane < NUM_LANES && blob->ok; lane++) {
+        const uint64_t count = stateRead(blob, 1);
+        if (count > MAX_HELD_NOTES) {
+            return false;
         }
-        //reset phase when sync is turned on
-        if (*self->sync != self->prev_sync) {
-            self->pos = resetPhase(self);
-            self->prev_sync = *self->sync;
+        snapshot->slot_count[lane]    = (uint8_t)count;
+        snapshot->octave_index[lane]  = (uint8_t)stateRead(blob, 1);
+        snapshot->pattern_index[lane] = (int16_t)stateRead(blob, 2);
+        for (uint64_t slot = 0; slot < count; slot++) {
+            const uint8_t note = (uint8_t)stateRead(blob, 1);
+            if (note >= 128 && note != ARP_STATE_FREE) {
+                return false;
+            }
+            snapshot->slots[lane][slot] = note;
         }
-        //reset phase when there is a new division
-        if (self->divisions != *self->changedDiv) {
-            self->divisions = *self->changedDiv;
-            self->pos = resetPhase(self);
+        if (snapshot->pattern_index[lane] < 0) {
+            return false;
         }
-        //set CV gate
-        if (self->notes_pressed > 0) {
-            self->cv_gate[i] = 1.0;
-        } else {
-            self->cv_gate[i] = 0.0;
+    }
+    return true;
+}
+
+
+static const PluginStateFormat arp_state_format = {
+    sizeof(ArpSnapshot), takeSnapshot, writeSnapshot, readSnapshot
+};
+
+
+// Replaces the notes of all lanes with the restored ones, on a block boundary.
+// The walk carries on where it was, the generator only when the seed is the
+// same, a new seed starts its own sequence.
+static void
+applySnapshot(Arpeggiator* self, const ArpSnapshot* snapshot)
+{
+    ArpLanes* lanes = &self->lanes;
+
+    for (int lane = 0; lane < NUM_LANES; lane++) {
+        clearLane(self, lane);
+        lanes->notes_pressed[lane] = 0;
+        lanes->latch_playing[lane] = (snapshot->slot_count[lane] > 0);
+
+        for (int slot = 0; slot < snapshot->slot_count[lane]; slot++) {
+            const uint8_t note = snapshot->slots[lane][slot];
+            if (note != ARP_STATE_FREE && lanes->note_count[lane] < self->held_capacity
+                    && !((lanes->held[lane][note >> 6] >> (note & 63)) & 1)) {
+                placeNote(lanes, lane, note, slot);
+            }
         }
+        lanes->pattern_index[lane] = snapshot->pattern_index[lane];
+        lanes->octave_index[lane]  = self->octave_table_length ? snapshot->octave_index[lane] % self->octave_table_length : 0;
+    }
+
+    if (snapshot->seed == self->params.seed) {
+        self->random = snapshot->random;
+    }
+}
+
+
+
+// Starts the notify sequence of the block, the counters are published on its
+// first frame about once a second.
+static void
+beginNotify(Arpeggiator* self, uint32_t n_samples)
+{
+    LV2_Atom_Forge_Frame seq_frame;
+
+    lv2_atom_forge_set_buffer(&self->forge, (uint8_t*)self->notify, sizeof(LV2_Atom) + self->notify->atom.size);
+    if (!lv2_atom_forge_sequence_head(&self->forge, &seq_frame, 0)) {
+        return;
+    }
+
+    if (self->perf_frames >= self->samplerate) {
+        perfPublish(&self->perf, &self->perf_uris, &self->forge, 0);
+        perfReset(&self->perf);
+        self->perf_frames = 0;
+    }
+    self->perf_frames += n_samples;
+
+    lv2_atom_forge_pop(&self->forge, &seq_frame);
+}
+
 
-        self->period = (uint32_t)(self->samplerate * (60.0f / (self->bpm * (self->divisions / 2.0f))));
-        self->h_wavelength = (self->period/2.0f);
 
-        if(self->pos >= self->period && i < n_samples) {
-            self->pos = 0;
+static void
+run(LV2_Handle instance, uint32_t n_samples)
+{
+    Arpeggiator* self = (Arpeggiator*)instance;
+    const ClockURIs* uris = &self->uris;
+
+    stateSequenceBegin(&self->state_sequence);
+
+    //the counters are only kept while someone listens
+    const uint64_t run_start = self->notify ? perfNow() : 0;
+    if (self->notify) {
+        beginNotify(self, n_samples);
+    }
+
+    self->MIDI_out->atom.type = self->MIDI_in->atom.type;
+
+    // Write an empty Sequence header to the output, the space the host gave
+    // us is looked up once and the events are written in place after it
+    midiWriterBegin(&self->out, self->MIDI_out, self->MIDI_out->atom.size, self->urid_midiEvent);
+
+    //control ports only change between blocks, take a snapshot and compare it
+    //to the previous one to see which transitions are needed
+    ArpParams params;
+    readParams(self, &params);
+
+    const bool new_mode       = (params.arp_mode != self->params.arp_mode);
+    const bool new_sync       = (params.sync != self->params.sync);
+    const bool new_division   = (params.divisions != self->params.divisions);
+    const bool new_length     = (params.note_length != self->params.note_length);
+    const bool new_octaves    = (params.octave_mode != self->params.octave_mode ||
+                                 params.octave_spread != self->params.octave_spread);
+    const bool latch_released = (!params.latch && self->params.latch);
+    const bool new_lanes      = (params.multi_lane != self->params.multi_lane);
+    const bool new_seed       = (params.seed != self->params.seed);
+    const bool new_enabled    = (params.enabled != self->params.enabled);
+    self->params = params;
+
+    //bypass toggled or the plugin was deactivated, nothing played before may
+    //stay on and the held notes start over
+    if (new_enabled || self->flush_pending) {
+        flushNotes(self, 0);
+        clearLanes(self);
+        self->flush_pending = false;
+    }
+
+    if (new_seed) {
+        randomSeed(&self->random, params.seed, RANDOM_STREAM);
+    }
+
+    //notes held on other channels would be stuck on their lanes, start over
+    if (new_lanes) {
+        clearLanes(self);
+        self->num_lanes = params.multi_lane ? NUM_LANES : 1;
+    }
+
+    self->bpm = currentBpm(self);
+    updateTempo(self, new_length);
+
+    //reset phase when sync is turned on or there is a new division
+    if (new_sync || new_division) {
+        self->pos = resetPhase(self);
+    }
+
+    //a group selected while running is joined by the worker, without one on
+    //the next activate()
+    const uint8_t group = (self->params.sync > 0) ? self->params.clock_group : 0;
+    if (self->schedule && sharedClockJoinWanted(&self->shared_clock, group)) {
+        if (self->schedule->schedule_work(self->schedule->handle, sizeof(group), &group) != LV2_WORKER_SUCCESS) {
+            self->shared_clock.requested = false;
+        }
+    }
+
+    if (sharedClockFollow(&self->shared_clock, group,
+                          &self->transport, self->frame, &self->clock, &self->pos, &self->triggered)) {
+        self->bpm = self->clock.bpm;
+        updateTempo(self, true);
+    }
+
+    if (new_octaves) {
+        buildOctaveTable(self);
+    }
+
+    if (new_mode) {
+        for (int lane = 0; lane < self->num_lanes; lane++) {
+            self->lanes.pattern_dirty[lane] = true;
+        }
+    }
+
+    //a restored state is taken over on the block boundary
+    if (stateHandoffBeginApply(&self->restore_flag)) {
+        applySnapshot(self, &self->restore);
+        stateHandoffEndApply(&self->restore_flag);
+    }
+
+    // Read incoming MIDI and transport events, each one is handled on the frame
+    // it arrives so the generated events are sample accurate and stay in order
+    uint32_t frame = 0;
+    LV2_ATOM_SEQUENCE_FOREACH(self->MIDI_in, ev)
+    {
+        const bool is_midi = (ev->body.type == self->urid_midiEvent);
+        const bool is_object = (ev->body.type == uris->atom_Object || ev->body.type == uris->atom_Blank);
+
+        if (!is_midi && !(is_object && ((const LV2_Atom_Object*)&ev->body)->body.otype == uris->time_Position)) {
+            continue;
+        }
+
+        uint32_t ev_frame = (ev->time.frames > frame) ? (uint32_t)ev->time.frames : frame;
+        ev_frame = (ev_frame < n_samples) ? ev_frame : n_samples;
+
+        runFrames(self, frame, ev_frame);
+        frame = ev_frame;
+
+        if (is_midi) {
+            if (self->notify) {
+                self->perf.events_in++;
+            }
+            processMidiEvent(self, ev);
         } else {
-            if((self->pos < self->h_wavelength && !self->triggered) || self->first_note) {
-                //trigger MIDI message
-                handleNoteOn(self, out_capacity);
-                self->triggered = true;
-                self->first_note = false;
-            } else if (self->pos > self->h_wavelength) {
-                //set gate
-                self->triggered = false;
+            const bool rolling = (self->transport.speed != 0);
+            const bool relock  = update_position(self, (const LV2_Atom_Object*)&ev->body);
+            self->stopped = self->stopped && self->transport.speed == 0;
+            if (params.sync > 0 && rolling && self->transport.speed == 0) {
+                //transport stopped, cut the notes instead of letting them ring on
+                flushNotes(self, ev_frame);
+                self->stopped = true;
+            } else if (relock && params.sync > 0) {
+                lockToHost(self);
+            }
+        }
+    }
+
+    if (latch_released) {
+        for (int lane = 0; lane < self->num_lanes; lane++) {
+            if (self->lanes.notes_pressed[lane] == 0) {
+                clearLane(self, lane);
+                soundingFlushChannel(&self->sounding, &self->out, lane, frame);
             }
         }
-        handleNoteOff(self, out_capacity);
-        self->pos += 1;
     }
-    self->previous_beat_in_measure = current_beat_pos;
+
+    runFrames(self, frame, n_samples);
+
+    const uint32_t dropped = midiWriterEnd(&self->out);
+    if (dropped > 0 && !self->overflow_reported) {
+        lv2_log_warning(&self->logger, "arpeggiator.lv2: MIDI output buffer full, events dropped\n");
+        self->overflow_reported = true;
+    }
+
+    if (self->notify) {
+        self->perf.events_out     += self->out.written;
+        self->perf.events_dropped += dropped;
+        perfBlock(&self->perf, run_start);
+    }
+
+    stateSequenceEnd(&self->state_sequence);
 }
 
 
 
+// No output can be written here, the notes that are left on are released on
+// the first frame of the next run().
 static void
 deactivate(LV2_Handle instance)
 {
+    Arpeggiator* self = (Arpeggiator*)instance;
+
+    self->flush_pending = true;
 }
 
 static void
 cleanup(LV2_Handle instance)
 {
-    free(instance);
+    Arpeggiator* self = (Arpeggiator*)instance;
+
+    sharedClockLeave(&self->shared_clock);
+    alignedInstanceFree(instance);
+}
+
+// Saves the state as it is between two blocks.
+static LV2_State_Status
+save(LV2_Handle                instance,
+        LV2_State_Store_Function  store,
+        LV2_State_Handle          handle,
+        uint32_t                  flags,
+        const LV2_Feature* const* features)
+{
+    Arpeggiator* self = (Arpeggiator*)instance;
+    ArpSnapshot  snapshot;
+
+    return pluginStateSave(&arp_state_format, self, &self->state_sequence, &snapshot,
+                           store, handle, self->uris.state, self->uris.atom_Chunk);
+}
+
+
+// May be called while run() is, the state is checked here and handed over
+// to run() whole.
+static LV2_State_Status
+restore(LV2_Handle                  instance,
+        LV2_State_Retrieve_Function retrieve,
+        LV2_State_Handle            handle,
+        uint32_t                    flags,
+        const LV2_Feature* const*   features)
+{
+    Arpeggiator* self = (Arpeggiator*)instance;
+    ArpSnapshot  snapshot;
+
+    const LV2_State_Status status = pluginStateRestore(&arp_state_format, &snapshot, &self->restore, &self->restore_flag,
+                                                       retrieve, handle, self->uris.state, self->uris.atom_Chunk);
+    if (status == LV2_STATE_ERR_UNKNOWN) {
+        lv2_log_warning(&self->logger, "arpeggiator.lv2: saved state not understood, ignored\n");
+    }
+    return status;
+}
+
+// Runs on the worker thread. The only job is joining the clock group, which
+// maps shared memory and can not be done in run().
+static LV2_Worker_Status
+work(LV2_Handle                  instance,
+        LV2_Worker_Respond_Function respond,
+        LV2_Worker_Respond_Handle   handle,
+        uint32_t                    size,
+        const void*                 data)
+{
+    Arpeggiator* self = (Arpeggiator*)instance;
+
+    sharedClockJoin(&self->shared_clock);
+    return LV2_WORKER_SUCCESS;
+}
+
+
+// run() picks the joined registry up by itself, nothing is sent back.
+static LV2_Worker_Status
+work_response(LV2_Handle instance, uint32_t size, const void* data)
+{
+    return LV2_WORKER_SUCCESS;
 }
 
 static const void*
 extension_data(const char* uri)
 {
+    static const LV2_State_Interface  state  = { save, restore };
+    static const LV2_Worker_Interface worker = { work, work_response, NULL };
+
+    if (!strcmp(uri, LV2_STATE__interface)) {
+        return &state;
+    }
+    if (!strcmp(uri, LV2_WORKER__interface)) {
+        return &worker;
+    }
     return NULL;
 }
 
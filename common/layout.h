@@ -0,0 +1,58 @@
+#ifndef LAYOUT_H
+#define LAYOUT_H
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+#define CACHE_LINE_SIZE 64
+
+// Starts a field or type on its own cache line.
+#define CACHE_ALIGNED __attribute__((aligned(CACHE_LINE_SIZE)))
+
+// Fails the build when the layout of an instance no longer holds.
+#define LAYOUT_CHECK(condition, message) _Static_assert(condition, message)
+
+// Fields from first up to and including last lie within the given number of
+// cache lines from the start of the type.
+#define LAYOUT_WITHIN_LINES(type, last, lines) \
+    (offsetof(type, last) + sizeof(((type*)0)->last) <= (lines) * CACHE_LINE_SIZE)
+
+
+// Zero filled memory that starts on a cache line, for the plugin instances.
+// Released with alignedInstanceFree().
+static inline void*
+alignedInstance(size_t size)
+{
+    void* mem = NULL;
+
+#ifdef _WIN32
+    mem = _aligned_malloc(size, CACHE_LINE_SIZE);
+    if (!mem) {
+        return NULL;
+    }
+#else
+    if (posix_memalign(&mem, CACHE_LINE_SIZE, size) != 0) {
+        return NULL;
+    }
+#endif
+    memset(mem, 0, size);
+    return mem;
+}
+
+
+static inline void
+alignedInstanceFree(void* mem)
+{
+#ifdef _WIN32
+    _aligned_free(mem);
+#else
+    free(mem);
+#endif
+}
+
+#endif
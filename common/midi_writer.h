@@ -0,0 +1,94 @@
+#ifndef MIDI_WRITER_H
+#define MIDI_WRITER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <lv2/lv2plug.in/ns/ext/atom/util.h>
+
+// Size of a 3 byte MIDI event in a sequence, including its padding.
+#define MIDI_WRITER_EVENT_SIZE (sizeof(LV2_Atom_Event) + 8)
+
+
+// Writes the events of one block straight into the output sequence. The
+// space the host provides is looked up once in midiWriterBegin(), events are
+// then written in place at a cursor and the sequence size is only set again
+// in midiWriterEnd(). Events that don't fit are counted instead of written.
+typedef struct {
+    LV2_Atom_Sequence* seq;
+    LV2_URID  midi_event;
+    uint8_t*  cursor;  // where the next event goes
+    uint8_t*  end;     // end of the space the host provides
+    uint32_t  written; // events written in this block
+    uint32_t  dropped; // events that did not fit in this block
+} MidiWriter;
+
+
+// Clears the output sequence, capacity is its atom size as set by the host.
+static inline void
+midiWriterBegin(MidiWriter* writer, LV2_Atom_Sequence* seq, uint32_t capacity, LV2_URID midi_event)
+{
+    lv2_atom_sequence_clear(seq);
+
+    writer->seq        = seq;
+    writer->midi_event = midi_event;
+    writer->cursor     = (uint8_t*)lv2_atom_sequence_end(&seq->body, seq->atom.size);
+    writer->end        = (uint8_t*)&seq->body + capacity;
+    writer->written    = 0;
+    writer->dropped    = 0;
+}
+
+
+static inline bool
+midiWriterNote(MidiWriter* writer, uint32_t frame, uint8_t status, uint8_t note, uint8_t velocity)
+{
+    if ((size_t)(writer->end - writer->cursor) < MIDI_WRITER_EVENT_SIZE) {
+        writer->dropped++;
+        return false;
+    }
+
+    LV2_Atom_Event* ev = (LV2_Atom_Event*)writer->cursor;
+    ev->time.frames = frame;
+    ev->body.size   = 3;
+    ev->body.type   = writer->midi_event;
+
+    uint8_t* msg = (uint8_t*)(ev + 1);
+    msg[0] = status;
+    msg[1] = note;
+    msg[2] = velocity;
+
+    writer->cursor += MIDI_WRITER_EVENT_SIZE;
+    writer->written++;
+    return true;
+}
+
+
+// Copies an incoming event to the output unchanged.
+static inline bool
+midiWriterForward(MidiWriter* writer, const LV2_Atom_Event* ev)
+{
+    const uint32_t size = (uint32_t)sizeof(LV2_Atom_Event) + ev->body.size;
+
+    if ((size_t)(writer->end - writer->cursor) < lv2_atom_pad_size(size)) {
+        writer->dropped++;
+        return false;
+    }
+
+    memcpy(writer->cursor, ev, size);
+    writer->cursor += lv2_atom_pad_size(size);
+    writer->written++;
+    return true;
+}
+
+
+// Sets the size of the output sequence, returns the number of dropped events.
+static inline uint32_t
+midiWriterEnd(MidiWriter* writer)
+{
+    writer->seq->atom.size = (uint32_t)(writer->cursor - (uint8_t*)&writer->seq->body);
+
+    return writer->dropped;
+}
+
+#endif
@@ -0,0 +1,157 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <lv2/lv2plug.in/ns/ext/atom/forge.h>
+#include <lv2/lv2plug.in/ns/ext/urid/urid.h>
+
+// Histogram buckets of the run() time, bucket i counts the blocks that took
+// from 2^i up to 2^(i+1) nanoseconds.
+#define PERF_BUCKETS 32
+
+
+// Counters of one plugin instance. They are only touched from run(), which
+// also publishes them, so nothing has to be shared with another thread.
+typedef struct {
+    uint32_t  blocks;
+    uint32_t  time_min; // run() time in nanoseconds, up to INT32_MAX
+    uint32_t  time_max;
+    uint64_t  time_sum;
+    uint32_t  buckets[PERF_BUCKETS];
+    uint32_t  events_in;
+    uint32_t  events_out;
+    uint32_t  events_dropped; // did not fit in the output buffer
+    uint32_t  notes_recovered; // notes released early so they could not hang
+} PerfCounters;
+
+
+// The statistics object is a <plugin>#Statistics with one Int property per
+// counter, the times are in nanoseconds.
+typedef struct {
+    LV2_URID  statistics;
+    LV2_URID  blocks;
+    LV2_URID  time_min;
+    LV2_URID  time_avg;
+    LV2_URID  time_max;
+    LV2_URID  time_p99;
+    LV2_URID  events_in;
+    LV2_URID  events_out;
+    LV2_URID  events_dropped;
+    LV2_URID  notes_recovered;
+} PerfURIs;
+
+
+static inline LV2_URID
+perfMapURI(LV2_URID_Map* map, const char* plugin_uri, const char* name)
+{
+    char uri[256];
+    snprintf(uri, sizeof(uri), "%s#%s", plugin_uri, name);
+    return map->map(map->handle, uri);
+}
+
+
+static inline void
+perfMapURIs(PerfURIs* uris, LV2_URID_Map* map, const char* plugin_uri)
+{
+    uris->statistics      = perfMapURI(map, plugin_uri, "Statistics");
+    uris->blocks          = perfMapURI(map, plugin_uri, "blocks");
+    uris->time_min        = perfMapURI(map, plugin_uri, "timeMin");
+    uris->time_avg        = perfMapURI(map, plugin_uri, "timeAvg");
+    uris->time_max        = perfMapURI(map, plugin_uri, "timeMax");
+    uris->time_p99        = perfMapURI(map, plugin_uri, "timeP99");
+    uris->events_in       = perfMapURI(map, plugin_uri, "eventsIn");
+    uris->events_out      = perfMapURI(map, plugin_uri, "eventsOut");
+    uris->events_dropped  = perfMapURI(map, plugin_uri, "eventsDropped");
+    uris->notes_recovered = perfMapURI(map, plugin_uri, "notesRecovered");
+}
+
+
+static inline void
+perfReset(PerfCounters* perf)
+{
+    memset(perf, 0, sizeof(PerfCounters));
+    perf->time_min = UINT32_MAX;
+}
+
+
+// Monotonic time in nanoseconds, a vDSO call on Linux.
+static inline uint64_t
+perfNow(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+
+// Adds the time of a run() that started at start.
+static inline void
+perfBlock(PerfCounters* perf, uint64_t start)
+{
+    const uint64_t elapsed = perfNow() - start;
+    const uint32_t time = (elapsed > INT32_MAX) ? INT32_MAX : (uint32_t)elapsed;
+
+    perf->blocks++;
+    perf->time_sum += time;
+    perf->time_min = (time < perf->time_min) ? time : perf->time_min;
+    perf->time_max = (time > perf->time_max) ? time : perf->time_max;
+    perf->buckets[31 - __builtin_clz(time | 1)]++;
+}
+
+
+// Upper bound of the bucket that holds the 99th percentile.
+static inline uint32_t
+perfP99(const PerfCounters* perf)
+{
+    const uint32_t above = perf->blocks / 100;
+    uint32_t count = 0;
+
+    for (int bucket = PERF_BUCKETS - 1; bucket >= 0; bucket--) {
+        count += perf->buckets[bucket];
+        if (count > above) {
+            return (bucket >= 30) ? INT32_MAX : (2u << bucket) - 1;
+        }
+    }
+    return 0;
+}
+
+
+// Writes the counters as one event to a sequence that is being forged.
+static inline void
+perfPublish(const PerfCounters* perf, const PerfURIs* uris, LV2_Atom_Forge* forge, uint32_t frame)
+{
+    LV2_Atom_Forge_Frame obj_frame;
+
+    const uint32_t blocks = perf->blocks;
+    const int32_t  values[] = {
+        (int32_t)blocks,
+        (int32_t)(blocks ? perf->time_min : 0),
+        (int32_t)(blocks ? perf->time_sum / blocks : 0),
+        (int32_t)perf->time_max,
+        (int32_t)perfP99(perf),
+        (int32_t)perf->events_in,
+        (int32_t)perf->events_out,
+        (int32_t)perf->events_dropped,
+        (int32_t)perf->notes_recovered,
+    };
+    const LV2_URID keys[] = {
+        uris->blocks, uris->time_min, uris->time_avg, uris->time_max, uris->time_p99,
+        uris->events_in, uris->events_out, uris->events_dropped, uris->notes_recovered,
+    };
+
+    if (!lv2_atom_forge_frame_time(forge, frame)
+            || !lv2_atom_forge_object(forge, &obj_frame, 0, uris->statistics)) {
+        return;
+    }
+    for (unsigned i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+        lv2_atom_forge_key(forge, keys[i]);
+        lv2_atom_forge_int(forge, values[i]);
+    }
+    lv2_atom_forge_pop(forge, &obj_frame);
+}
+
+#endif
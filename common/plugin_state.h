@@ -0,0 +1,232 @@
+#ifndef PLUGIN_STATE_H
+#define PLUGIN_STATE_H
+
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <lv2/lv2plug.in/ns/ext/state/state.h>
+#include <lv2/lv2plug.in/ns/ext/urid/urid.h>
+
+// The state of a plugin is saved as one chunk of bytes. The fields are
+// written one by one in little endian order, so a session loads the same on
+// every machine.
+#define PLUGIN_STATE_MAX 4096
+
+typedef struct {
+    uint8_t   data[PLUGIN_STATE_MAX];
+    uint32_t  size;
+    uint32_t  read; // position of the next field to read
+    bool      ok;   // false once a field did not fit or was missing
+} StateBlob;
+
+
+static inline void
+stateBlobInit(StateBlob* blob)
+{
+    blob->size = 0;
+    blob->read = 0;
+    blob->ok   = true;
+}
+
+
+// Takes over saved data to read it, false when it does not fit.
+static inline bool
+stateBlobLoad(StateBlob* blob, const void* data, size_t size)
+{
+    stateBlobInit(blob);
+    if (size > PLUGIN_STATE_MAX) {
+        return false;
+    }
+    memcpy(blob->data, data, size);
+    blob->size = (uint32_t)size;
+    return true;
+}
+
+
+static inline void
+stateWrite(StateBlob* blob, uint64_t value, unsigned bytes)
+{
+    if (blob->size + bytes > PLUGIN_STATE_MAX) {
+        blob->ok = false;
+        return;
+    }
+    for (unsigned i = 0; i < bytes; i++) {
+        blob->data[blob->size++] = (uint8_t)(value >> (8 * i));
+    }
+}
+
+
+static inline uint64_t
+stateRead(StateBlob* blob, unsigned bytes)
+{
+    uint64_t value = 0;
+
+    if (blob->read + bytes > blob->size) {
+        blob->ok = false;
+        return 0;
+    }
+    for (unsigned i = 0; i < bytes; i++) {
+        value |= (uint64_t)blob->data[blob->read++] << (8 * i);
+    }
+    return value;
+}
+
+
+// A restore is handed to the audio thread through a flag. restore() fills the
+// buffer of the instance and marks it ready, run() takes it over on its next
+// block boundary. run() never waits, while the buffer is being written it
+// looks again on the next block.
+enum {
+    STATE_IDLE = 0,
+    STATE_WRITING,
+    STATE_READY,
+    STATE_APPLYING
+};
+
+
+// Not real-time safe, waits until run() is done with a previous restore. A
+// restore that was not taken over yet is replaced.
+static inline void
+stateHandoffBeginWrite(uint32_t* flag)
+{
+    for (;;) {
+        uint32_t expected = __atomic_load_n(flag, __ATOMIC_ACQUIRE);
+        if ((expected == STATE_IDLE || expected == STATE_READY)
+                && __atomic_compare_exchange_n(flag, &expected, STATE_WRITING, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return;
+        }
+        sched_yield();
+    }
+}
+
+
+static inline void
+stateHandoffEndWrite(uint32_t* flag)
+{
+    __atomic_store_n(flag, STATE_READY, __ATOMIC_RELEASE);
+}
+
+
+// Called by run(), true when there is a restore to take over.
+static inline bool
+stateHandoffBeginApply(uint32_t* flag)
+{
+    uint32_t expected = STATE_READY;
+
+    return __atomic_load_n(flag, __ATOMIC_RELAXED) == STATE_READY
+        && __atomic_compare_exchange_n(flag, &expected, STATE_APPLYING, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+
+static inline void
+stateHandoffEndApply(uint32_t* flag)
+{
+    __atomic_store_n(flag, STATE_IDLE, __ATOMIC_RELEASE);
+}
+
+
+// save() may run while run() does, so run() counts its blocks in a sequence
+// that is odd while it changes the state. save() reads the state between two
+// blocks and tries again when a block ran in the meantime.
+static inline void
+stateSequenceBegin(uint32_t* sequence)
+{
+    __atomic_store_n(sequence, *sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+
+static inline void
+stateSequenceEnd(uint32_t* sequence)
+{
+    __atomic_store_n(sequence, *sequence + 1, __ATOMIC_RELEASE);
+}
+
+
+static inline uint32_t
+stateReadBegin(const uint32_t* sequence)
+{
+    uint32_t value;
+
+    while ((value = __atomic_load_n(sequence, __ATOMIC_ACQUIRE)) & 1) {
+        sched_yield();
+    }
+    return value;
+}
+
+
+static inline bool
+stateReadRetry(const uint32_t* sequence, uint32_t begin)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(sequence, __ATOMIC_RELAXED) != begin;
+}
+
+
+// How a plugin turns its state into bytes and back. take() copies the state
+// of the instance into a snapshot, write() and read() convert a snapshot,
+// read() returns false for a state it does not understand.
+typedef struct {
+    size_t    snapshot_size;
+    void    (*take)(const void* instance, void* snapshot);
+    void    (*write)(const void* snapshot, StateBlob* blob);
+    bool    (*read)(void* snapshot, StateBlob* blob);
+} PluginStateFormat;
+
+
+// Saves the state as it is between two blocks as a chunk under key.
+// snapshot is room for one snapshot of the format.
+static inline LV2_State_Status
+pluginStateSave(const PluginStateFormat* format, const void* instance, const uint32_t* sequence, void* snapshot,
+                LV2_State_Store_Function store, LV2_State_Handle handle, LV2_URID key, LV2_URID chunk)
+{
+    StateBlob blob;
+    uint32_t  begin;
+
+    do {
+        begin = stateReadBegin(sequence);
+        format->take(instance, snapshot);
+    } while (stateReadRetry(sequence, begin));
+
+    stateBlobInit(&blob);
+    format->write(snapshot, &blob);
+    if (!blob.ok) {
+        return LV2_STATE_ERR_NO_SPACE;
+    }
+    return store(handle, key, blob.data, blob.size, chunk, LV2_STATE_IS_POD | LV2_STATE_IS_PORTABLE);
+}
+
+
+// May be called while run() is. The saved chunk is read into snapshot and
+// checked here, and only a whole state is handed to run() through restore.
+// Returns LV2_STATE_ERR_UNKNOWN for a state the format does not understand.
+static inline LV2_State_Status
+pluginStateRestore(const PluginStateFormat* format, void* snapshot, void* restore, uint32_t* flag,
+                   LV2_State_Retrieve_Function retrieve, LV2_State_Handle handle, LV2_URID key, LV2_URID chunk)
+{
+    StateBlob blob;
+    size_t    size;
+    uint32_t  type;
+    uint32_t  value_flags;
+
+    const void* data = retrieve(handle, key, &size, &type, &value_flags);
+    if (!data) {
+        return LV2_STATE_ERR_NO_PROPERTY;
+    }
+    if (type != chunk) {
+        return LV2_STATE_ERR_BAD_TYPE;
+    }
+    if (!stateBlobLoad(&blob, data, size) || !format->read(snapshot, &blob) || !blob.ok || blob.read != blob.size) {
+        return LV2_STATE_ERR_UNKNOWN;
+    }
+
+    stateHandoffBeginWrite(flag);
+    memcpy(restore, snapshot, format->snapshot_size);
+    stateHandoffEndWrite(flag);
+
+    return LV2_STATE_SUCCESS;
+}
+
+#endif
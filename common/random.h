@@ -0,0 +1,56 @@
+#ifndef RANDOM_H
+#define RANDOM_H
+
+#include <stdint.h>
+
+// PCG32 generator owned by one plugin instance. Unlike libc random() it
+// takes no lock and the same seed gives the same sequence, so offline
+// renders are reproducible.
+typedef struct {
+    uint64_t  state;
+    uint64_t  inc; // stream, always odd
+} Random;
+
+
+static inline uint32_t
+randomNext(Random* random)
+{
+    const uint64_t old = random->state;
+    random->state = old * 6364136223846793005ULL + random->inc;
+
+    const uint32_t xorshifted = (uint32_t)(((old >> 18u) ^ old) >> 27u);
+    const uint32_t rot = (uint32_t)(old >> 59u);
+    return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+}
+
+
+static inline void
+randomSeed(Random* random, uint64_t seed, uint64_t stream)
+{
+    random->state = 0;
+    random->inc   = (stream << 1u) | 1u;
+    randomNext(random);
+    random->state += seed;
+    randomNext(random);
+}
+
+
+// Uniform draw from 0 up to bound, without the bias of a plain modulo
+// (Lemire's multiply and reject). bound has to be above 0.
+static inline uint32_t
+randomBelow(Random* random, uint32_t bound)
+{
+    uint64_t product = (uint64_t)randomNext(random) * bound;
+    uint32_t low = (uint32_t)product;
+
+    if (low < bound) {
+        const uint32_t threshold = -bound % bound;
+        while (low < threshold) {
+            product = (uint64_t)randomNext(random) * bound;
+            low = (uint32_t)product;
+        }
+    }
+    return (uint32_t)(product >> 32);
+}
+
+#endif
@@ -0,0 +1,343 @@
+#ifndef SHARED_CLOCK_H
+#define SHARED_CLOCK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "step_clock.h"
+#include "transport.h"
+
+// The groups live in POSIX shared memory. Where there is none the plugins
+// only use their own clock.
+#if !defined(_WIN32)
+#define SHARED_CLOCK_SHM 1
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <dirent.h>
+#endif
+#else
+#define SHARED_CLOCK_SHM 0
+#endif
+
+#define SHARED_CLOCK_GROUPS 8
+#define SHARED_CLOCK_MAGIC  0x42474331
+#define SHARED_CLOCK_CLOSED 0x80000000u // set in users when the last one left
+#define SHARED_CLOCK_PREFIX "bg-lv2-clock."
+
+
+// Step grid of one clock group for the current cycle. The slot is a seqlock,
+// the sequence is odd while an instance writes it and readers try again
+// when it changed under them.
+typedef struct {
+    uint32_t  sequence;
+    int64_t   host_frame; // host frame at the start of the cycle
+    double    beat;       // quarter note position at host_frame
+    float     bpm;        // quarter notes per minute
+} __attribute__((aligned(64))) SharedClockSlot;
+
+
+// Process wide registry of the clock groups. The plugins are separate
+// binaries, so it lives in a shared memory object named after the process
+// that every instance in a group maps, and is removed when the last one
+// leaves.
+typedef struct {
+    uint32_t  magic;
+    uint32_t  users;
+    SharedClockSlot slots[SHARED_CLOCK_GROUPS];
+} SharedClockRegistry;
+
+
+// Registry of one instance, only mapped once the instance joins a group, so
+// instances on their own clock leave nothing behind in shared memory. The
+// join runs in activate() or on a worker thread, run() only reads registry.
+typedef struct {
+    SharedClockRegistry* registry; // NULL while not joined or not available
+    bool      tried;     // joining is only tried once
+    bool      requested; // run() asked for the join, only touched by run()
+} SharedClock;
+
+
+#if SHARED_CLOCK_SHM
+
+static inline void
+sharedClockName(char* name, size_t size)
+{
+    snprintf(name, size, "/" SHARED_CLOCK_PREFIX "%ld", (long)getpid());
+}
+
+
+// A host that crashed leaves its object behind, nothing unlinks it then.
+// On Linux the objects are files in /dev/shm, the ones of processes that no
+// longer exist are removed before a new registry is mapped. Elsewhere they
+// stay until the next reboot.
+static inline void
+sharedClockRemoveStale(void)
+{
+#if defined(__linux__)
+    DIR* dir = opendir("/dev/shm");
+    if (!dir) {
+        return;
+    }
+
+    const size_t   prefix = strlen(SHARED_CLOCK_PREFIX);
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, SHARED_CLOCK_PREFIX, prefix) != 0) {
+            continue;
+        }
+        char*      end = NULL;
+        const long pid = strtol(entry->d_name + prefix, &end, 10);
+        if (pid <= 0 || *end != '\0' || pid == (long)getpid()) {
+            continue;
+        }
+        if (kill((pid_t)pid, 0) != 0 && errno == ESRCH) {
+            char name[300];
+            snprintf(name, sizeof(name), "/%s", entry->d_name);
+            shm_unlink(name);
+        }
+    }
+    closedir(dir);
+#endif
+}
+
+
+// Maps the object of the process, sized by whoever created it. Returns NULL
+// when that is not possible.
+static inline SharedClockRegistry*
+sharedClockMap(const char* name)
+{
+    const int fd = shm_open(name, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    //only the first one sizes it, macOS refuses to size an object twice
+    struct stat st;
+    bool sized = fstat(fd, &st) == 0 && st.st_size == sizeof(SharedClockRegistry);
+    if (!sized) {
+        sized = ftruncate(fd, sizeof(SharedClockRegistry)) == 0
+             || (fstat(fd, &st) == 0 && st.st_size == sizeof(SharedClockRegistry));
+    }
+    if (!sized) {
+        close(fd);
+        return NULL;
+    }
+
+    void* mem = mmap(NULL, sizeof(SharedClockRegistry), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    return (mem == MAP_FAILED) ? NULL : (SharedClockRegistry*)mem;
+}
+
+
+// Not real-time safe, called once per instance. A registry the last user is
+// removing is not joined, the name is opened again once it is gone.
+static inline SharedClockRegistry*
+sharedClockAttach(void)
+{
+    char name[64];
+    sharedClockName(name, sizeof(name));
+    sharedClockRemoveStale();
+
+    for (int attempt = 0; attempt < 1000; attempt++) {
+        SharedClockRegistry* registry = sharedClockMap(name);
+        if (!registry) {
+            return NULL;
+        }
+
+        //a new object is zero filled, mark it as ours
+        uint32_t empty = 0;
+        __atomic_compare_exchange_n(&registry->magic, &empty, SHARED_CLOCK_MAGIC, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&registry->magic, __ATOMIC_ACQUIRE) != SHARED_CLOCK_MAGIC) {
+            munmap(registry, sizeof(SharedClockRegistry));
+            return NULL;
+        }
+
+        uint32_t users = __atomic_load_n(&registry->users, __ATOMIC_ACQUIRE);
+        while (!(users & SHARED_CLOCK_CLOSED)) {
+            if (__atomic_compare_exchange_n(&registry->users, &users, users + 1, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                return registry;
+            }
+        }
+
+        munmap(registry, sizeof(SharedClockRegistry));
+        sched_yield();
+    }
+    return NULL;
+}
+
+
+// The last user closes the registry before it removes the name, so an
+// instance that attaches in between can not join the registry being removed.
+static inline void
+sharedClockDetach(SharedClockRegistry* registry)
+{
+    uint32_t users = __atomic_load_n(&registry->users, __ATOMIC_ACQUIRE);
+    bool     last  = false;
+
+    for (;;) {
+        last = (users == 1);
+        if (__atomic_compare_exchange_n(&registry->users, &users, last ? SHARED_CLOCK_CLOSED : users - 1,
+                                        false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+    }
+
+    if (last) {
+        char name[64];
+        sharedClockName(name, sizeof(name));
+        shm_unlink(name);
+    }
+    munmap(registry, sizeof(SharedClockRegistry));
+}
+
+#else
+
+static inline SharedClockRegistry*
+sharedClockAttach(void)
+{
+    return NULL;
+}
+
+
+static inline void
+sharedClockDetach(SharedClockRegistry* registry)
+{
+}
+
+#endif
+
+
+// Joins the registry the first time it is called, later calls do nothing.
+// Not real-time safe, called from activate() or the worker, and publishes the
+// registry to run() once it is mapped.
+static inline void
+sharedClockJoin(SharedClock* shared)
+{
+    if (!__atomic_exchange_n(&shared->tried, true, __ATOMIC_ACQ_REL)) {
+        __atomic_store_n(&shared->registry, sharedClockAttach(), __ATOMIC_RELEASE);
+    }
+}
+
+
+// Real-time safe. True once, when run() first follows a group that is not
+// joined yet, the plugin then hands sharedClockJoin() to its worker.
+static inline bool
+sharedClockJoinWanted(SharedClock* shared, uint8_t group)
+{
+    if (group == 0 || shared->requested) {
+        return false;
+    }
+    shared->requested = true;
+    return !__atomic_load_n(&shared->tried, __ATOMIC_ACQUIRE);
+}
+
+
+static inline void
+sharedClockLeave(SharedClock* shared)
+{
+    if (shared->registry) {
+        sharedClockDetach(shared->registry);
+        shared->registry = NULL;
+    }
+}
+
+
+// Takes the grid of a group for the cycle that starts at host_frame. The
+// first instance to run in a cycle publishes the beat and tempo it passes
+// in, the others get them back, so the whole group steps on the same
+// frames. Lock-free, when a writer is in the way the own values are kept.
+static inline void
+sharedClockCycle(SharedClockRegistry* registry, int group, int64_t host_frame, double* beat, float* bpm)
+{
+    SharedClockSlot* slot = &registry->slots[group];
+
+    for (int attempt = 0; attempt < 4; attempt++) {
+        const uint32_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        if (sequence & 1) {
+            continue;
+        }
+
+        int64_t frame;
+        double  slot_beat;
+        float   slot_bpm;
+        __atomic_load(&slot->host_frame, &frame, __ATOMIC_RELAXED);
+        __atomic_load(&slot->beat, &slot_beat, __ATOMIC_RELAXED);
+        __atomic_load(&slot->bpm, &slot_bpm, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) != sequence) {
+            continue;
+        }
+        if (frame == host_frame) {
+            *beat = slot_beat;
+            *bpm  = slot_bpm;
+            return;
+        }
+
+        //first one in this cycle
+        uint32_t expected = sequence;
+        if (__atomic_compare_exchange_n(&slot->sequence, &expected, sequence + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            __atomic_store(&slot->host_frame, &host_frame, __ATOMIC_RELAXED);
+            __atomic_store(&slot->beat, beat, __ATOMIC_RELAXED);
+            __atomic_store(&slot->bpm, bpm, __ATOMIC_RELAXED);
+            __atomic_store_n(&slot->sequence, sequence + 2, __ATOMIC_RELEASE);
+            return;
+        }
+    }
+}
+
+
+// In a clock group the first instance to run in a cycle publishes where the
+// host grid is, the others take that over, so arpeggiators and patterns of
+// the group step together. Only followed while the transport rolls and the
+// host sends its frame, group 0 is the own clock. Real-time safe, a group
+// that is not joined yet is left alone until the worker joined it.
+//
+// Moves pos and triggered onto the grid of the group and returns true when
+// the group changed the tempo of the clock.
+static inline bool
+sharedClockFollow(const SharedClock* shared, uint8_t group, const Transport* transport, uint32_t frame,
+                  StepClock* clock, uint32_t* pos, bool* triggered)
+{
+    const int64_t host_frame = transportHostFrameAt(transport, frame);
+
+    if (group == 0 || host_frame < 0 || transport->speed == 0) {
+        return false;
+    }
+
+    SharedClockRegistry* registry = __atomic_load_n(&shared->registry, __ATOMIC_ACQUIRE);
+    if (!registry) {
+        return false;
+    }
+
+    double beat = transportQuarterBeat(transport, frame);
+    float  bpm  = transportQuarterBpm(transport);
+    sharedClockCycle(registry, group - 1, host_frame, &beat, &bpm);
+
+    const bool new_tempo = stepClockUpdate(clock, clock->samplerate, bpm, clock->divisions);
+
+    //leave the own clock alone when it is at most a frame apart, it would
+    //otherwise play the start of a step twice, and keep the fractional frames
+    //it carries, only a relock starts them over
+    const uint32_t phase = stepClockPhaseOf(clock, beat);
+    const uint32_t diff  = (phase > *pos) ? phase - *pos : *pos - phase;
+    if (diff > 1 && diff < clock->period - 1) {
+        clock->fraction = 0;
+        *pos = phase;
+        *triggered = (phase != 0);
+    }
+
+    return new_tempo;
+}
+
+#endif
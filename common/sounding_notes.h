@@ -0,0 +1,77 @@
+#ifndef SOUNDING_NOTES_H
+#define SOUNDING_NOTES_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "midi_writer.h"
+
+// Notes that are on at the output of a plugin, one bit per pitch and MIDI
+// channel. Looking a note up is a single bit test, and a flush walks the set
+// bits only, so it costs as much as there are notes on, not 16 times 128.
+typedef struct {
+    uint64_t  bits[16][2];
+    uint16_t  channels; // channels with at least one note on
+} SoundingNotes;
+
+
+static inline void
+soundingOn(SoundingNotes* sounding, uint8_t channel, uint8_t note)
+{
+    sounding->bits[channel & 15][(note >> 6) & 1] |= (uint64_t)1 << (note & 63);
+    sounding->channels |= (uint16_t)(1u << (channel & 15));
+}
+
+
+// Returns true when the note was on.
+static inline bool
+soundingOff(SoundingNotes* sounding, uint8_t channel, uint8_t note)
+{
+    uint64_t* const bits = sounding->bits[channel & 15];
+    const uint64_t  mask = (uint64_t)1 << (note & 63);
+
+    if (!(bits[(note >> 6) & 1] & mask)) {
+        return false;
+    }
+    bits[(note >> 6) & 1] &= ~mask;
+    if (!bits[0] && !bits[1]) {
+        sounding->channels &= (uint16_t)~(1u << (channel & 15));
+    }
+    return true;
+}
+
+
+// Sends a note-off for every note that is on on a channel, returns how many.
+static inline uint32_t
+soundingFlushChannel(SoundingNotes* sounding, MidiWriter* writer, uint8_t channel, uint32_t frame)
+{
+    uint32_t count = 0;
+
+    for (int word = 0; word < 2; word++) {
+        uint64_t bits = sounding->bits[channel & 15][word];
+        while (bits) {
+            const int bit = __builtin_ctzll(bits);
+            midiWriterNote(writer, frame, 0x80 | (channel & 15), (uint8_t)(word * 64 + bit), 0);
+            bits &= bits - 1;
+            count++;
+        }
+        sounding->bits[channel & 15][word] = 0;
+    }
+    sounding->channels &= (uint16_t)~(1u << (channel & 15));
+
+    return count;
+}
+
+
+static inline uint32_t
+soundingFlush(SoundingNotes* sounding, MidiWriter* writer, uint32_t frame)
+{
+    uint32_t count = 0;
+
+    while (sounding->channels) {
+        count += soundingFlushChannel(sounding, writer, (uint8_t)__builtin_ctz(sounding->channels), frame);
+    }
+    return count;
+}
+
+#endif
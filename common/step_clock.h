@@ -0,0 +1,94 @@
+#ifndef STEP_CLOCK_H
+#define STEP_CLOCK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Fixed point one (32.32) used for the step length and phase.
+#define STEP_CLOCK_ONE 4294967296.0
+
+
+// Timing of the steps of a plugin, derived from the tempo and divisions.
+// The step length is only recomputed when one of its inputs changes. It is
+// kept in 32.32 fixed point and the fractional frames are carried from step
+// to step, so long runs don't drift from truncating the length to frames.
+typedef struct {
+    double    samplerate;
+    float     bpm;
+    float     divisions;
+    uint64_t  step_length;  // frames per step, 32.32 fixed point
+    uint32_t  fraction;     // fractional frames carried into the next step
+    uint32_t  period;       // length of the current step in frames
+    uint32_t  h_wavelength; // half of the current step
+} StepClock;
+
+
+static inline void
+stepClockSetPeriod(StepClock* clock, uint32_t period)
+{
+    clock->period = period;
+    clock->h_wavelength = period / 2;
+}
+
+
+// Returns true when the step length changed.
+static inline bool
+stepClockUpdate(StepClock* clock, double samplerate, float bpm, float divisions)
+{
+    if (clock->samplerate == samplerate && clock->bpm == bpm && clock->divisions == divisions) {
+        return false;
+    }
+    clock->samplerate = samplerate;
+    clock->bpm = bpm;
+    clock->divisions = divisions;
+
+    //without a tempo the clock does not advance
+    if (bpm <= 0 || divisions <= 0) {
+        clock->step_length = (uint64_t)UINT32_MAX << 32;
+    } else {
+        clock->step_length = (uint64_t)(samplerate * (60.0 / (bpm * (divisions / 2.0))) * STEP_CLOCK_ONE);
+    }
+    clock->fraction = 0;
+    stepClockSetPeriod(clock, (uint32_t)(clock->step_length >> 32));
+
+    return true;
+}
+
+
+// Called on every step boundary, sets the length of the step that starts.
+static inline void
+stepClockNextStep(StepClock* clock)
+{
+    const uint64_t length = clock->step_length + clock->fraction;
+
+    clock->fraction = (uint32_t)length;
+    stepClockSetPeriod(clock, (uint32_t)(length >> 32));
+}
+
+
+// Returns the position in frames within the current step for a position in
+// beats, without touching the clock.
+static inline uint32_t
+stepClockPhaseOf(const StepClock* clock, double beat)
+{
+    if (clock->bpm <= 0 || beat <= 0) {
+        return 0;
+    }
+
+    const uint64_t position = (uint64_t)(clock->samplerate * (60.0 / clock->bpm) * beat * STEP_CLOCK_ONE);
+
+    return (uint32_t)((position % clock->step_length) >> 32);
+}
+
+
+// Same as stepClockPhaseOf(), used to line up with the host transport, so
+// the fractional frames carried so far are dropped.
+static inline uint32_t
+stepClockPhase(StepClock* clock, double beat)
+{
+    clock->fraction = 0;
+
+    return stepClockPhaseOf(clock, beat);
+}
+
+#endif
@@ -0,0 +1,225 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <lv2/lv2plug.in/ns/ext/atom/util.h>
+#include <lv2/lv2plug.in/ns/ext/time/time.h>
+#include <lv2/lv2plug.in/ns/ext/urid/urid.h>
+
+// Host transport as told by the time:Position objects, each one is applied at
+// the frame it arrives on. In between the position is extrapolated from the
+// tempo, so a plugin only has to line its step clock up with the host again
+// when the transport starts, relocates or changes tempo, never per frame.
+typedef struct {
+    double    samplerate;
+    float     bpm;           // tempo in beats per minute, 0 until the host sends one
+    float     beat_unit;     // note value of a beat, 4 for quarter notes
+    float     beats_per_bar;
+    float     speed;         // 0 when stopped, 1 when rolling
+    double    beat;          // beat within the bar at `frame`
+    int64_t   host_frame;    // host frame at `frame`, -1 when unknown
+    uint32_t  frame;         // running frame counter of the plugin the position belongs to
+} Transport;
+
+
+typedef struct {
+    LV2_URID atom_Double;
+    LV2_URID atom_Float;
+    LV2_URID atom_Int;
+    LV2_URID atom_Long;
+    LV2_URID time_barBeat;
+    LV2_URID time_beatUnit;
+    LV2_URID time_beatsPerBar;
+    LV2_URID time_beatsPerMinute;
+    LV2_URID time_frame;
+    LV2_URID time_speed;
+} TransportURIs;
+
+
+// Fields of one time:Position object, the has_ flags tell which ones it holds.
+typedef struct {
+    bool      has_bpm, has_beat_unit, has_beats_per_bar, has_speed, has_beat, has_frame;
+    float     bpm;
+    float     beat_unit;
+    float     beats_per_bar;
+    float     speed;
+    double    beat;
+    int64_t   frame;
+} TransportUpdate;
+
+
+static inline void
+transportMapURIs(TransportURIs* uris, LV2_URID_Map* map)
+{
+    uris->atom_Double         = map->map(map->handle, LV2_ATOM__Double);
+    uris->atom_Float          = map->map(map->handle, LV2_ATOM__Float);
+    uris->atom_Int            = map->map(map->handle, LV2_ATOM__Int);
+    uris->atom_Long           = map->map(map->handle, LV2_ATOM__Long);
+    uris->time_barBeat        = map->map(map->handle, LV2_TIME__barBeat);
+    uris->time_beatUnit       = map->map(map->handle, LV2_TIME__beatUnit);
+    uris->time_beatsPerBar    = map->map(map->handle, LV2_TIME__beatsPerBar);
+    uris->time_beatsPerMinute = map->map(map->handle, LV2_TIME__beatsPerMinute);
+    uris->time_frame          = map->map(map->handle, LV2_TIME__frame);
+    uris->time_speed          = map->map(map->handle, LV2_TIME__speed);
+}
+
+
+// Reads a number atom of any of the types hosts use for the time properties.
+static inline bool
+transportReadNumber(const TransportURIs* uris, const LV2_Atom* atom, double* value)
+{
+    if (!atom) {
+        return false;
+    }
+    if (atom->type == uris->atom_Float) {
+        *value = ((const LV2_Atom_Float*)atom)->body;
+    } else if (atom->type == uris->atom_Double) {
+        *value = ((const LV2_Atom_Double*)atom)->body;
+    } else if (atom->type == uris->atom_Int) {
+        *value = ((const LV2_Atom_Int*)atom)->body;
+    } else if (atom->type == uris->atom_Long) {
+        *value = (double)((const LV2_Atom_Long*)atom)->body;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+
+static inline void
+transportParse(const TransportURIs* uris, const LV2_Atom_Object* obj, TransportUpdate* update)
+{
+    LV2_Atom *beat = NULL, *bpm = NULL, *speed = NULL, *frame = NULL, *beat_unit = NULL, *beats_per_bar = NULL;
+    double    value;
+
+    memset(update, 0, sizeof(TransportUpdate));
+
+    lv2_atom_object_get(obj,
+            uris->time_barBeat, &beat,
+            uris->time_beatsPerMinute, &bpm,
+            uris->time_speed, &speed,
+            uris->time_frame, &frame,
+            uris->time_beatUnit, &beat_unit,
+            uris->time_beatsPerBar, &beats_per_bar,
+            NULL);
+
+    if ((update->has_bpm = transportReadNumber(uris, bpm, &value))) {
+        update->bpm = (float)value;
+    }
+    if ((update->has_speed = transportReadNumber(uris, speed, &value))) {
+        update->speed = (float)value;
+    }
+    if ((update->has_beat = transportReadNumber(uris, beat, &value))) {
+        update->beat = value;
+    }
+    if ((update->has_beat_unit = transportReadNumber(uris, beat_unit, &value))) {
+        update->beat_unit = (float)value;
+    }
+    if ((update->has_beats_per_bar = transportReadNumber(uris, beats_per_bar, &value))) {
+        update->beats_per_bar = (float)value;
+    }
+    if ((update->has_frame = (frame && frame->type == uris->atom_Long))) {
+        update->frame = ((const LV2_Atom_Long*)frame)->body;
+    }
+}
+
+
+static inline void
+transportInit(Transport* transport, double samplerate)
+{
+    transport->samplerate    = samplerate;
+    transport->bpm           = 0.0f;
+    transport->beat_unit     = 4.0f;
+    transport->beats_per_bar = 4.0f;
+    transport->speed         = 0.0f;
+    transport->beat          = 0.0;
+    transport->host_frame    = -1;
+    transport->frame         = 0;
+}
+
+
+// Host frame at a frame at or after the last update, -1 when unknown.
+static inline int64_t
+transportHostFrameAt(const Transport* transport, uint32_t frame)
+{
+    if (transport->host_frame < 0) {
+        return -1;
+    }
+    return transport->host_frame + (int64_t)(uint32_t)(frame - transport->frame) * (transport->speed != 0);
+}
+
+
+// Beat within the bar at a frame at or after the last update.
+static inline double
+transportBeatAt(const Transport* transport, uint32_t frame)
+{
+    const uint32_t elapsed = frame - transport->frame;
+    double beat = transport->beat + elapsed * transport->speed * (transport->bpm / (60.0 * transport->samplerate));
+
+    if (transport->beats_per_bar > 0 && beat >= transport->beats_per_bar) {
+        beat -= transport->beats_per_bar * (int64_t)(beat / transport->beats_per_bar);
+    }
+    return beat;
+}
+
+
+// The step clocks count in quarter notes, the host in its beat unit.
+static inline float
+transportQuarterBpm(const Transport* transport)
+{
+    return transport->bpm * 4.0f / transport->beat_unit;
+}
+
+
+static inline double
+transportQuarterBeat(const Transport* transport, uint32_t frame)
+{
+    return transportBeatAt(transport, frame) * 4.0 / transport->beat_unit;
+}
+
+
+// Applies a position received on the given frame. Returns true when the step
+// clock has to be lined up with the host again: the transport started, the
+// tempo or meter changed, or the host frame jumped.
+static inline bool
+transportApply(Transport* transport, uint32_t frame, const TransportUpdate* update)
+{
+    bool relock = false;
+
+    //move the anchor to this frame first, what the object leaves out is extrapolated
+    const int64_t expected = transportHostFrameAt(transport, frame);
+    transport->beat       = transportBeatAt(transport, frame);
+    transport->host_frame = expected;
+    transport->frame      = frame;
+
+    if (update->has_bpm && update->bpm != transport->bpm) {
+        transport->bpm = update->bpm;
+        relock = true;
+    }
+    if (update->has_beat_unit && update->beat_unit > 0 && update->beat_unit != transport->beat_unit) {
+        transport->beat_unit = update->beat_unit;
+        relock = true;
+    }
+    if (update->has_beats_per_bar && update->beats_per_bar != transport->beats_per_bar) {
+        transport->beats_per_bar = update->beats_per_bar;
+        relock = true;
+    }
+    if (update->has_speed) {
+        relock = relock || (update->speed != 0 && transport->speed == 0);
+        transport->speed = update->speed;
+    }
+    if (update->has_frame) {
+        relock = relock || (update->frame != expected);
+        transport->host_frame = update->frame;
+    }
+    if (update->has_beat) {
+        transport->beat = update->beat;
+    }
+
+    return relock;
+}
+
+#endif
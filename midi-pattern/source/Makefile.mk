@@ -54,6 +54,11 @@ else
 LINK_FLAGS      = $(LINK_OPTS) -Wl,--no-undefined $(LDFLAGS)
 endif
 
+ifeq ($(LINUX),true)
+# shm_open() is in librt before glibc 2.34
+LINK_FLAGS     += -lrt
+endif
+
 # --------------------------------------------------------------
 # Set shared lib extension
 
@@ -9,8 +9,18 @@
 #include <lv2/lv2plug.in/ns/ext/atom/forge.h>
 #include <lv2/lv2plug.in/ns/ext/log/logger.h>
 #include <lv2/lv2plug.in/ns/ext/midi/midi.h>
+#include <lv2/lv2plug.in/ns/ext/state/state.h>
 #include "lv2/lv2plug.in/ns/ext/time/time.h"
 #include <lv2/lv2plug.in/ns/ext/urid/urid.h>
+#include <lv2/lv2plug.in/ns/ext/worker/worker.h>
+
+#include "../../common/layout.h"
+#include "../../common/midi_writer.h"
+#include "../../common/plugin_state.h"
+#include "../../common/random.h"
+#include "../../common/shared_clock.h"
+#include "../../common/step_clock.h"
+#include "../../common/transport.h"
 
 #ifndef DEBUG
 #define DEBUG 0
@@ -19,16 +29,14 @@
     ((void)((DEBUG) ? fprintf(stderr, __VA_ARGS__) : 0))
 
 #define NUM_VOICES 16
+#define NUM_FADERS 8
+#define MAX_ACCENT_EVERY 16
+#define MAX_PATTERN_STEPS (NUM_FADERS * MAX_ACCENT_EVERY) // longest cycle of the faders and the accents
+#define PATTERN_RANDOM_STREAM 0x50415454
+#define PATTERN_STATE_VERSION 1
 #define PLUGIN_URI "http://bramgiesen.com/midi-pattern"
 
 
-// Struct for a 3 byte MIDI event
-typedef struct {
-    LV2_Atom_Event event;
-    uint8_t        msg[3];
-} LV2_Atom_MIDI;
-
-
 typedef enum {
     MIDI_IN                = 0,
     MIDI_OUT               = 1,
@@ -43,65 +51,91 @@ typedef enum {
     PATTERNVEL5            = 10,
     PATTERNVEL6            = 11,
     PATTERNVEL7            = 12,
-    PATTERNVEL8            = 13
+    PATTERNVEL8            = 13,
+    CLOCK_GROUP            = 14,
+    PROBABILITY            = 15,
+    ACCENT                 = 16,
+    ACCENT_EVERY           = 17
 } PortIndex;
 
 
+// Control port values, read once at the start of every block.
+typedef struct {
+    float     divisions;
+    uint8_t   sync;
+    uint8_t   clock_group; // 0 for the own clock
+    uint8_t   pattern_length;
+    uint8_t   velocities[NUM_FADERS];
+    uint8_t   probability;  // chance of a step to play in percent
+    uint8_t   accent;       // velocity added to accented steps
+    uint8_t   accent_every; // every how many steps an accent falls, 0 for none
+} PatternParams;
+
+
+// Velocity and chance of every step of the pattern, built from the controls
+// when one of them changes so playing a step is a single lookup. The table
+// holds one whole cycle: the faders of the pattern repeat until the accents
+// fall on its first step again.
+typedef struct {
+    uint8_t   velocity[MAX_PATTERN_STEPS];
+    uint8_t   chance[MAX_PATTERN_STEPS]; // out of 255, 255 always plays
+    uint8_t   length;
+} StepTable;
+
+
 typedef struct {
     LV2_URID atom_Blank;
-    LV2_URID atom_Float;
     LV2_URID atom_Object;
     LV2_URID atom_Path;
     LV2_URID atom_Resource;
     LV2_URID atom_Sequence;
     LV2_URID time_Position;
-    LV2_URID time_barBeat;
-    LV2_URID time_beatsPerMinute;
-    LV2_URID time_speed;
+    LV2_URID atom_Chunk;
+    LV2_URID state; // key of the saved state
+    TransportURIs transport;
 } ClockURIs;
 
-typedef struct {
-
-    LV2_URID_Map*          map; // URID map feature
-    LV2_Log_Log* 	       log;
-    LV2_Log_Logger      logger; // Logger API
-    ClockURIs             uris; // Cache of mapped URIDs
-
-    // URIDs
-    LV2_URID urid_midiEvent;
 
-    const LV2_Atom_Sequence* MIDI_in;
-    LV2_Atom_Sequence*       MIDI_out;
+// What a saved session carries over, so the pattern goes on with the step
+// it was on and the same draws.
+typedef struct {
+    Random    random;
+    uint8_t   pattern_index;
+    bool      step_playing;
+} PatternSnapshot;
 
-    float     divisions;
-    double    samplerate;
-    int       prevSync;
+// Laid out like the arpeggiator: the state touched on every processed frame
+// fills the first two cache lines, the setup is kept apart at the end.
+typedef struct {
+    // per frame
+    uint32_t  pos CACHE_ALIGNED;
+    uint32_t  frame; // running frame counter
+    uint8_t   pattern_index;
+    uint8_t   current_velocity;
+    bool      step_playing; // false when the current step lost its draw
+    bool      triggered;
+    Random    random; // draws of the step chances
+    StepClock clock;
+    float*    cv_retrigger;
+    size_t    prev_cv_retrigger;
+    PatternParams params; // control values of the current block
 
+    // per step and per block
+    StepTable steps;
+    MidiWriter out; // writes the output events of the current block
     // Variables to keep track of the tempo information sent by the host
     float     bpm; // Beats per minute (tempo)
-    uint32_t  pos;
-    uint32_t  period;
-    uint32_t  h_wavelength;
-    size_t    pattern_index;
-    size_t    prev_cv_retrigger;
-    int       octave_index;
-    bool      triggered;
-    float     speed; // Transport speed (usually 0=stop, 1=play)
     float     prev_speed;
-    float     beat_in_measure;
-    uint8_t   current_velocity;
-    float   **velocity_pattern[8];
+    Transport transport; // host position
+    SharedClock shared_clock; // joined once a clock group is selected
+    uint32_t  state_sequence; // odd while run() changes the state
+    uint32_t  restore_flag; // hands a restore over to run()
+    PatternSnapshot restore; // restored state, taken over by run()
 
-    float 	  elapsed_len; // Frames since the start of the last click
-    uint32_t  wave_offset; // Current play offset in the wave
-
-    // Envelope parameters
-    uint32_t  attack_len;
-    uint32_t  decay_len;
-
-    float*    change_bpm;
+    const LV2_Atom_Sequence* MIDI_in;
+    LV2_Atom_Sequence*       MIDI_out;
+    float   **velocity_pattern[NUM_FADERS];
     float*    changed_div;
-    float*    cv_retrigger;
     float*    sync;
     float*    velocity_pattern_length_param;
     float*    pattern_vel1_param;
@@ -112,25 +146,26 @@ typedef struct {
     float*    pattern_vel6_param;
     float*    pattern_vel7_param;
     float*    pattern_vel8_param;
-} MidiPattern;
-
-
+    float*    clock_group;
+    float*    probability;
+    float*    accent;
+    float*    accent_every;
 
-static LV2_Atom_MIDI
-createMidiEvent(MidiPattern* self, uint8_t status, uint8_t note, uint8_t velocity)
-{
-    LV2_Atom_MIDI msg;
-    memset(&msg, 0, sizeof(LV2_Atom_MIDI));
+    // setup
+    LV2_URID_Map*          map CACHE_ALIGNED; // URID map feature
+    LV2_Log_Log* 	       log;
+    LV2_Worker_Schedule*   schedule; // optional, joins a clock group selected while running
+    LV2_Log_Logger      logger; // Logger API
+    ClockURIs             uris; // Cache of mapped URIDs
 
-    msg.event.body.size = 3;
-    msg.event.body.type = self->urid_midiEvent;
+    // URIDs
+    LV2_URID urid_midiEvent;
 
-    msg.msg[0] = status;
-    msg.msg[1] = note;
-    msg.msg[2] = velocity;
+    double    samplerate;
+    bool      overflow_reported;
+} MidiPattern;
 
-    return msg;
-}
+LAYOUT_CHECK(LAYOUT_WITHIN_LINES(MidiPattern, params, 2), "per frame state of the midi pattern has to fit in two cache lines");
 
 
 
@@ -184,6 +219,18 @@ connect_port(LV2_Handle instance,
         case PATTERNVEL8:
             self->pattern_vel8_param = (float*)data;
             break;
+        case CLOCK_GROUP:
+            self->clock_group = (float*)data;
+            break;
+        case PROBABILITY:
+            self->probability = (float*)data;
+            break;
+        case ACCENT:
+            self->accent = (float*)data;
+            break;
+        case ACCENT_EVERY:
+            self->accent_every = (float*)data;
+            break;
     }
 }
 
@@ -193,7 +240,15 @@ static void
 activate(LV2_Handle instance)
 {
     MidiPattern* self = (MidiPattern*)instance;
-    self->divisions =*self->changed_div;
+    self->params.divisions = *self->changed_div;
+
+    //a render starts from the same draws
+    randomSeed(&self->random, 0, PATTERN_RANDOM_STREAM);
+
+    //a group selected before the start is joined here, off the audio thread
+    if (*self->clock_group >= 1 && *self->clock_group <= SHARED_CLOCK_GROUPS) {
+        sharedClockJoin(&self->shared_clock);
+    }
 }
 
 
@@ -204,7 +259,7 @@ instantiate(const LV2_Descriptor*     descriptor,
         const char*               bundle_path,
         const LV2_Feature* const* features)
 {
-    MidiPattern* self = (MidiPattern*)calloc(1, sizeof(MidiPattern));
+    MidiPattern* self = (MidiPattern*)alignedInstance(sizeof(MidiPattern));
 
     if (!self)
     {
@@ -221,13 +276,17 @@ instantiate(const LV2_Descriptor*     descriptor,
         {
             self->log = (LV2_Log_Log*)features[i]->data;
         }
+        else if (!strcmp (features[i]->URI, LV2_WORKER__schedule))
+        {
+            self->schedule = (LV2_Worker_Schedule*)features[i]->data;
+        }
     }
 
     lv2_log_logger_init (&self->logger, self->map, self->log);
 
     if (!self->map) {
         lv2_log_error (&self->logger, "midi-pattern.lv2 error: Host does not support urid:map\n");
-        free (self);
+        alignedInstanceFree(self);
         return NULL;
     }
 
@@ -236,24 +295,24 @@ instantiate(const LV2_Descriptor*     descriptor,
     LV2_URID_Map* const map   = self->map;
     self->urid_midiEvent      = map->map(map->handle, LV2_MIDI__MidiEvent);
     uris->atom_Blank          = map->map(map->handle, LV2_ATOM__Blank);
-    uris->atom_Float          = map->map(map->handle, LV2_ATOM__Float);
     uris->atom_Object         = map->map(map->handle, LV2_ATOM__Object);
     uris->atom_Path           = map->map(map->handle, LV2_ATOM__Path);
     uris->atom_Resource       = map->map(map->handle, LV2_ATOM__Resource);
     uris->atom_Sequence       = map->map(map->handle, LV2_ATOM__Sequence);
     uris->time_Position       = map->map(map->handle, LV2_TIME__Position);
-    uris->time_barBeat        = map->map(map->handle, LV2_TIME__barBeat);
-    uris->time_beatsPerMinute = map->map(map->handle, LV2_TIME__beatsPerMinute);
-    uris->time_speed          = map->map(map->handle, LV2_TIME__speed);
+    uris->atom_Chunk          = map->map(map->handle, LV2_ATOM__Chunk);
+    uris->state               = map->map(map->handle, PLUGIN_URI "#state");
+    transportMapURIs(&uris->transport, map);
 
     debug_print("DEBUGING");
     self->samplerate = rate;
-    self->prevSync   = 0;
-    self->beat_in_measure = 0;
+    self->frame = 0;
+    transportInit(&self->transport, rate);
     self->prev_speed = 0;
     self->pattern_index = 0;
+    self->step_playing = true;
+    randomSeed(&self->random, 0, PATTERN_RANDOM_STREAM);
     self->triggered = false;
-    self->pattern_index = 0;
     self->current_velocity = 0;
     self->pos = 0;
 
@@ -272,148 +331,369 @@ instantiate(const LV2_Descriptor*     descriptor,
 
 
 
-static void
-update_position(MidiPattern* self, const LV2_Atom_Object* obj)
+// Applies a transport position received on the given frame of the block,
+// returns true when the step clock has to be lined up with the host again.
+static bool
+update_position(MidiPattern* self, const LV2_Atom_Object* obj, uint32_t frame)
 {
-    const ClockURIs* uris = &self->uris;
+    TransportUpdate update;
 
     // Received new transport position/speed
-    LV2_Atom *beat = NULL, *bpm = NULL, *speed = NULL;
-    lv2_atom_object_get(obj,
-            uris->time_barBeat, &beat,
-            uris->time_beatsPerMinute, &bpm,
-            uris->time_speed, &speed,
-            NULL);
-    if (bpm && bpm->type == uris->atom_Float)
-    {
-        // Tempo changed, update BPM
-        self->bpm = ((LV2_Atom_Float*)bpm)->body;
+    transportParse(&self->uris.transport, obj, &update);
+
+    return transportApply(&self->transport, self->frame + frame, &update);
+}
+
+
+
+static uint32_t
+resetPhase(MidiPattern* self, uint32_t frame)
+{
+    return stepClockPhase(&self->clock, transportQuarterBeat(&self->transport, self->frame + frame));
+}
+
+
+// Takes over the tempo of the host, the phase is only moved to where the host
+// is when playing starts or stops, the host jumped or changed tempo or reset
+// is set.
+static void
+followTransport(MidiPattern* self, uint32_t frame, bool reset)
+{
+    //the step length is only recomputed when tempo or divisions changed
+    self->bpm = transportQuarterBpm(&self->transport);
+    stepClockUpdate(&self->clock, self->samplerate, self->bpm, self->params.divisions);
+
+    if (self->transport.speed != self->prev_speed || reset) {
+        self->pos = resetPhase(self, frame);
+        self->prev_speed = self->transport.speed;
     }
-    if (speed && speed->type == uris->atom_Float)
-    {
-        // Speed changed, e.g. 0 (stop) to 1 (play)
-        self->speed = ((LV2_Atom_Float*)speed)->body;
+}
+
+
+static void
+readParams(const MidiPattern* self, PatternParams* params)
+{
+    params->divisions      = *self->changed_div;
+    params->sync           = (uint8_t)*self->sync;
+    params->clock_group    = (uint8_t)*self->clock_group;
+    params->clock_group    = (params->clock_group > SHARED_CLOCK_GROUPS) ? 0 : params->clock_group;
+    params->pattern_length = (uint8_t)*self->velocity_pattern_length_param;
+    params->pattern_length = (params->pattern_length < 1) ? 1 : (params->pattern_length > NUM_FADERS) ? NUM_FADERS : params->pattern_length;
+    for (unsigned i = 0; i < NUM_FADERS; i++) {
+        params->velocities[i] = (uint8_t)**self->velocity_pattern[i];
     }
-    if (beat && beat->type == uris->atom_Float)
-    {
-        // Received a beat position, synchronise
-        // This hard sync may cause clicks, a real plugin would be more graceful
-        const float frames_per_beat = (self->samplerate * (60.0f / (self->bpm * self->divisions)));
-        const float bar_beats       = (((LV2_Atom_Float*)beat)->body * self->divisions);
-        const float beat_beats      = bar_beats - floorf(bar_beats);
-        self->beat_in_measure         = ((LV2_Atom_Float*)beat)->body; 
-        self->elapsed_len           = beat_beats * frames_per_beat;
+    params->probability    = (uint8_t)fminf(fmaxf(*self->probability, 0.0f), 100.0f);
+    params->accent         = (uint8_t)fminf(fmaxf(*self->accent, 0.0f), 127.0f);
+    params->accent_every   = (uint8_t)fminf(fmaxf(*self->accent_every, 0.0f), MAX_ACCENT_EVERY);
+}
+
+
+static bool
+stepTableChanged(const PatternParams* a, const PatternParams* b)
+{
+    return a->pattern_length != b->pattern_length || a->probability != b->probability
+        || a->accent != b->accent || a->accent_every != b->accent_every
+        || memcmp(a->velocities, b->velocities, NUM_FADERS) != 0;
+}
+
+
+static void
+buildStepTable(StepTable* steps, const PatternParams* params)
+{
+    const uint8_t chance = (uint8_t)((params->probability * 255 + 50) / 100);
+
+    //the cycle is the least common multiple of the pattern length and the accents
+    unsigned length = params->pattern_length;
+    if (params->accent_every > 0) {
+        unsigned a = length, b = params->accent_every;
+        while (b != 0) {
+            const unsigned r = a % b;
+            a = b;
+            b = r;
+        }
+        length = length / a * params->accent_every;
+    }
+
+    for (unsigned i = 0; i < length; i++) {
+        const bool accented = params->accent_every > 0 && i % params->accent_every == 0;
+        const unsigned velocity = params->velocities[i % params->pattern_length] + (accented ? params->accent : 0);
+
+        steps->velocity[i] = (velocity > 127) ? 127 : (uint8_t)velocity;
+        //accents always play
+        steps->chance[i]   = accented ? 255 : chance;
+    }
+    steps->length = (uint8_t)length;
+}
+
+
+// Goes to a step of the pattern and draws whether it plays.
+static void
+enterStep(MidiPattern* self, uint8_t index)
+{
+    const uint8_t chance = self->steps.chance[index];
+
+    self->pattern_index    = index;
+    self->step_playing     = (chance == 255) || randomBelow(&self->random, 255) < chance;
+    self->current_velocity = self->step_playing ? self->steps.velocity[index] : 0;
+}
+
+
+static void
+nextStep(MidiPattern* self)
+{
+    enterStep(self, (self->pattern_index + 1 >= self->steps.length) ? 0 : self->pattern_index + 1);
+}
+
+
+// The frame loop is compiled into a variant with and one without host sync,
+// like the arpeggiator does, so it does not check the mode on every frame.
+#define PATTERN_ALWAYS_INLINE static inline __attribute__((always_inline))
+
+
+// Returns the number of frames from the current position on in which nothing
+// else happens than the phase moving forward.
+PATTERN_ALWAYS_INLINE uint32_t
+nextEventOffset(const MidiPattern* self, uint32_t remaining, bool sync)
+{
+    if (self->pos >= self->clock.period) {
+        return 0;
+    }
+
+    //next step boundary
+    uint32_t offset = self->clock.period - self->pos;
+
+    if (sync) {
+        if (!self->triggered) {
+            if (self->pos < self->clock.h_wavelength) {
+                return 0;
+            }
+        } else {
+            if (self->pos > self->clock.h_wavelength) {
+                return 0;
+            }
+            //frame where the trigger is released
+            offset = (self->clock.h_wavelength + 1 - self->pos < offset) ? self->clock.h_wavelength + 1 - self->pos : offset;
+        }
     }
+
+    return (offset < remaining) ? offset : remaining;
 }
 
 
 
+// First frame from start on where the retrigger CV changes, end when it doesn't.
 static uint32_t
-resetPhase(MidiPattern* self)
+nextRetrigger(const MidiPattern* self, uint32_t start, uint32_t end)
+{
+    for (uint32_t i = start; i < end; i++) {
+        if ((size_t)self->cv_retrigger[i] != self->prev_cv_retrigger) {
+            return i;
+        }
+    }
+    return end;
+}
+
+
+
+// Brings the pattern to the state of the given frame without moving on, so
+// it can be called again for the same frame.
+PATTERN_ALWAYS_INLINE void
+clockFrameFor(MidiPattern* self, uint32_t frame, bool sync)
+{
+    if ((size_t)self->cv_retrigger[frame] != self->prev_cv_retrigger) {
+        self->prev_cv_retrigger = (size_t)self->cv_retrigger[frame];
+        if (self->cv_retrigger[frame] == 1) {
+            enterStep(self, 0);
+        }
+    }
+
+    //a new step starts on this very frame
+    if(self->pos >= self->clock.period) {
+        self->pos = 0;
+        stepClockNextStep(&self->clock);
+    }
+
+    if (sync) {
+        if((self->pos < self->clock.h_wavelength && !self->triggered)) {
+            nextStep(self);
+            self->triggered = true;
+        } else if (self->pos > self->clock.h_wavelength) {
+            self->triggered = false;
+        }
+    }
+}
+
+
+
+static void
+clockFrame(MidiPattern* self, uint32_t frame)
 {
-    uint32_t pos = (uint32_t)fmod(self->samplerate * (60.0f / self->bpm) * self->beat_in_measure, (self->samplerate * (60.0f / (self->bpm * (self->divisions / 2.0f)))));
+    clockFrameFor(self, frame, self->params.sync > 0);
+}
+
 
-    return pos;
+
+PATTERN_ALWAYS_INLINE void
+runFramesFor(MidiPattern* self, uint32_t start, uint32_t end, bool sync)
+{
+    //jump from one step boundary or retrigger to the next instead of stepping every sample
+    uint32_t retrigger = nextRetrigger(self, start, end);
+    uint32_t i = start;
+    while (i < end) {
+        if (retrigger < i) {
+            retrigger = nextRetrigger(self, i, end);
+        }
+        const uint32_t idle_frames = nextEventOffset(self, retrigger - i, sync);
+
+        if (idle_frames > 0) {
+            self->pos += idle_frames;
+            i += idle_frames;
+        } else {
+            clockFrameFor(self, i, sync);
+            self->pos += 1;
+            i++;
+        }
+    }
 }
 
 
+static void
+runFramesSynced(MidiPattern* self, uint32_t start, uint32_t end)
+{
+    runFramesFor(self, start, end, true);
+}
+
+
+static void
+runFramesFree(MidiPattern* self, uint32_t start, uint32_t end)
+{
+    runFramesFor(self, start, end, false);
+}
+
+
+
 static void
 run(LV2_Handle instance, uint32_t n_samples)
 {
     MidiPattern* self = (MidiPattern*)instance;
     const ClockURIs* uris = &self->uris;
 
-    self->MIDI_out->atom.type = self->MIDI_in->atom.type;
+    stateSequenceBegin(&self->state_sequence);
 
-    const uint32_t out_capacity = self->MIDI_out->atom.size;
+    //control ports only change between blocks, take a snapshot and compare it
+    //to the previous one to see which transitions are needed
+    PatternParams params;
+    readParams(self, &params);
 
-    // Write an empty Sequence header to the output
-    lv2_atom_sequence_clear(self->MIDI_out);
+    const bool new_sync     = (params.sync != self->params.sync);
+    const bool new_division = (params.divisions != self->params.divisions);
+    const bool new_steps    = stepTableChanged(&params, &self->params) || self->steps.length == 0;
+    self->params = params;
 
-    // Read incoming events
-    LV2_ATOM_SEQUENCE_FOREACH(self->MIDI_in, ev)
-    {
-        if (ev->body.type == uris->atom_Object ||
-                ev->body.type == uris->atom_Blank) {
-            const LV2_Atom_Object* obj = (const LV2_Atom_Object*)&ev->body;
-            if (obj->body.otype == uris->time_Position) {
-                update_position(self, obj);
-            }
-        }
-        else if (ev->body.type == self->urid_midiEvent)
-        {
-            const uint8_t* const msg = (const uint8_t*)(ev + 1);
-
-            //const uint8_t channel = msg[0] & 0x0F;
-            const uint8_t status  = msg[0] & 0xF0;
-
-            uint8_t midi_note = msg[1];
-            uint8_t velocity = 0;
-
-            switch (status)
-            {
-                case LV2_MIDI_MSG_NOTE_ON:
-                    velocity = self->current_velocity;
-                    if (*self->sync == 0) {
-                        self->pattern_index = (self->pattern_index + 1) % (uint8_t)*self->velocity_pattern_length_param;
-                    }
-                case LV2_MIDI_MSG_NOTE_OFF:
-                    break;
-                default:
-                    break;
-            }
-            LV2_Atom_MIDI midi_msg = createMidiEvent(self, status, midi_note, velocity);
-            lv2_atom_sequence_append_event(self->MIDI_out, out_capacity, (LV2_Atom_Event*)&midi_msg);
+    if (new_steps) {
+        buildStepTable(&self->steps, &params);
+        if (self->pattern_index >= self->steps.length) {
+            self->pattern_index %= self->steps.length;
         }
+        //keep the draw of the current step
+        self->current_velocity = self->step_playing ? self->steps.velocity[self->pattern_index] : 0;
     }
 
-    for(uint32_t i = 0; i < n_samples; i ++) {
-        //reset phase when playing starts or stops
-        if (self->speed != self->prev_speed) {
-            self->pos = resetPhase(self);
-            self->prev_speed = self->speed;
-        }
-        //reset phase when sync is turned on
-        if (*self->sync != self->prevSync) {
-            self->pos = resetPhase(self);
-            self->prevSync = *self->sync;
-        }
-        //reset phase when there is a new division
-        if (self->divisions != *self->changed_div) {
-            self->divisions = *self->changed_div;
-            self->pos = resetPhase(self);
+    //a restored state is taken over on the block boundary
+    if (stateHandoffBeginApply(&self->restore_flag)) {
+        self->random           = self->restore.random;
+        self->pattern_index    = self->restore.pattern_index % self->steps.length;
+        self->step_playing     = self->restore.step_playing;
+        self->current_velocity = self->step_playing ? self->steps.velocity[self->pattern_index] : 0;
+        stateHandoffEndApply(&self->restore_flag);
+    }
+
+    self->MIDI_out->atom.type = self->MIDI_in->atom.type;
+
+    // Write an empty Sequence header to the output, the space the host gave
+    // us is looked up once and the events are written in place after it
+    midiWriterBegin(&self->out, self->MIDI_out, self->MIDI_out->atom.size, self->urid_midiEvent);
+
+    //reset phase when sync is turned on or there is a new division
+    followTransport(self, 0, new_sync || new_division);
+    //a group selected while running is joined by the worker, without one on
+    //the next activate()
+    const uint8_t group = (self->params.sync > 0) ? self->params.clock_group : 0;
+    if (self->schedule && sharedClockJoinWanted(&self->shared_clock, group)) {
+        if (self->schedule->schedule_work(self->schedule->handle, sizeof(group), &group) != LV2_WORKER_SUCCESS) {
+            self->shared_clock.requested = false;
         }
+    }
 
-        if ((size_t)*self->cv_retrigger != self->prev_cv_retrigger) {
-            self->prev_cv_retrigger = (size_t)*self->cv_retrigger;
-            if (*self->cv_retrigger == 1) {
-                self->pattern_index = 0;
-            }
+    if (sharedClockFollow(&self->shared_clock, group,
+                          &self->transport, self->frame, &self->clock, &self->pos, &self->triggered)) {
+        self->bpm = self->clock.bpm;
+    }
+
+    // Read incoming MIDI and transport events, the clock runs up to the frame
+    // of every event first so a note gets the velocity of the step it falls in
+    void (*runFrames)(MidiPattern*, uint32_t, uint32_t) = (params.sync > 0) ? runFramesSynced : runFramesFree;
+    uint32_t frame = 0;
+    LV2_ATOM_SEQUENCE_FOREACH(self->MIDI_in, ev)
+    {
+        const bool is_midi = (ev->body.type == self->urid_midiEvent);
+        const bool is_object = (ev->body.type == uris->atom_Object || ev->body.type == uris->atom_Blank);
+
+        if (!is_midi && !(is_object && ((const LV2_Atom_Object*)&ev->body)->body.otype == uris->time_Position)) {
+            continue;
         }
 
-        self->period = (uint32_t)(self->samplerate * (60.0f / (self->bpm * (self->divisions / 2.0f))));
-        self->h_wavelength = (self->period/2.0f);
+        uint32_t ev_frame = (ev->time.frames > frame) ? (uint32_t)ev->time.frames : frame;
+        ev_frame = (ev_frame < n_samples) ? ev_frame : n_samples;
 
-        if(self->pos >= self->period && i < n_samples) {
-            self->pos = 0;
+        runFrames(self, frame, ev_frame);
+        frame = ev_frame;
+
+        if (!is_midi) {
+            followTransport(self, ev_frame, update_position(self, (const LV2_Atom_Object*)&ev->body, ev_frame));
+            continue;
         }
 
-        if (*self->sync > 0) {
-            if((self->pos < self->h_wavelength && !self->triggered)) {
-                self->pattern_index = (self->pattern_index + 1) % (uint8_t)*self->velocity_pattern_length_param;
-                self->triggered = true;
-            } else if (self->pos > self->h_wavelength) {
-                //set gate
-                self->triggered = false;
-            }
+        const uint8_t* const msg = (const uint8_t*)(ev + 1);
+
+        //const uint8_t channel = msg[0] & 0x0F;
+        const uint8_t status  = msg[0] & 0xF0;
+
+        uint8_t midi_note = msg[1];
+        uint8_t velocity = 0;
+
+        switch (status)
+        {
+            case LV2_MIDI_MSG_NOTE_ON:
+                if (ev_frame < n_samples) {
+                    clockFrame(self, ev_frame);
+                }
+                velocity = self->current_velocity;
+                if (params.sync == 0) {
+                    nextStep(self);
+                }
+            case LV2_MIDI_MSG_NOTE_OFF:
+                break;
+            default:
+                break;
         }
-    self->current_velocity = (uint8_t)**self->velocity_pattern[self->pattern_index];
-    self->pos += 1;
+        midiWriterNote(&self->out, ev_frame, status, midi_note, velocity);
     }
+
+    runFrames(self, frame, n_samples);
+    self->frame += n_samples;
+
+    if (midiWriterEnd(&self->out) > 0 && !self->overflow_reported) {
+        lv2_log_warning(&self->logger, "midi-pattern.lv2: MIDI output buffer full, events dropped\n");
+        self->overflow_reported = true;
+    }
+
+    stateSequenceEnd(&self->state_sequence);
 }
 
 
 
+
 static void
 deactivate(LV2_Handle instance)
 {
@@ -422,12 +702,131 @@ deactivate(LV2_Handle instance)
 static void
 cleanup(LV2_Handle instance)
 {
-    free(instance);
+    MidiPattern* self = (MidiPattern*)instance;
+
+    sharedClockLeave(&self->shared_clock);
+    alignedInstanceFree(instance);
+}
+
+static void
+takeSnapshot(const void* instance, void* snapshot_out)
+{
+    const MidiPattern* self     = (const MidiPattern*)instance;
+    PatternSnapshot*   snapshot = (PatternSnapshot*)snapshot_out;
+
+    snapshot->random        = self->random;
+    snapshot->pattern_index = self->pattern_index;
+    snapshot->step_playing  = self->step_playing;
+}
+
+
+static void
+writeSnapshot(const void* snapshot_in, StateBlob* blob)
+{
+    const PatternSnapshot* snapshot = (const PatternSnapshot*)snapshot_in;
+
+    stateWrite(blob, PATTERN_STATE_VERSION, 1);
+    stateWrite(blob, snapshot->pattern_index, 1);
+    stateWrite(blob, snapshot->step_playing, 1);
+    stateWrite(blob, snapshot->random.state, 8);
+    stateWrite(blob, snapshot->random.inc, 8);
+}
+
+
+// Returns false when the saved state is not one this version understands.
+static bool
+readSnapshot(void* snapshot_out, StateBlob* blob)
+{
+    PatternSnapshot* snapshot = (PatternSnapshot*)snapshot_out;
+
+    if (stateRead(blob, 1) != PATTERN_STATE_VERSION) {
+        return false;
+    }
+    snapshot->pattern_index = (uint8_t)stateRead(blob, 1);
+    snapshot->step_playing  = stateRead(blob, 1) != 0;
+    snapshot->random.state  = stateRead(blob, 8);
+    snapshot->random.inc    = stateRead(blob, 8) | 1u;
+
+    return snapshot->pattern_index < MAX_PATTERN_STEPS;
+}
+
+
+static const PluginStateFormat pattern_state_format = {
+    sizeof(PatternSnapshot), takeSnapshot, writeSnapshot, readSnapshot
+};
+
+
+// Saves the state as it is between two blocks.
+static LV2_State_Status
+save(LV2_Handle                instance,
+        LV2_State_Store_Function  store,
+        LV2_State_Handle          handle,
+        uint32_t                  flags,
+        const LV2_Feature* const* features)
+{
+    MidiPattern*    self = (MidiPattern*)instance;
+    PatternSnapshot snapshot;
+
+    return pluginStateSave(&pattern_state_format, self, &self->state_sequence, &snapshot,
+                           store, handle, self->uris.state, self->uris.atom_Chunk);
+}
+
+
+// May be called while run() is, the state is checked here and handed over
+// to run() whole.
+static LV2_State_Status
+restore(LV2_Handle                  instance,
+        LV2_State_Retrieve_Function retrieve,
+        LV2_State_Handle            handle,
+        uint32_t                    flags,
+        const LV2_Feature* const*   features)
+{
+    MidiPattern*    self = (MidiPattern*)instance;
+    PatternSnapshot snapshot;
+
+    const LV2_State_Status status = pluginStateRestore(&pattern_state_format, &snapshot, &self->restore, &self->restore_flag,
+                                                       retrieve, handle, self->uris.state, self->uris.atom_Chunk);
+    if (status == LV2_STATE_ERR_UNKNOWN) {
+        lv2_log_warning(&self->logger, "midi-pattern.lv2: saved state not understood, ignored\n");
+    }
+    return status;
+}
+
+// Runs on the worker thread. The only job is joining the clock group, which
+// maps shared memory and can not be done in run().
+static LV2_Worker_Status
+work(LV2_Handle                  instance,
+        LV2_Worker_Respond_Function respond,
+        LV2_Worker_Respond_Handle   handle,
+        uint32_t                    size,
+        const void*                 data)
+{
+    MidiPattern* self = (MidiPattern*)instance;
+
+    sharedClockJoin(&self->shared_clock);
+    return LV2_WORKER_SUCCESS;
+}
+
+
+// run() picks the joined registry up by itself, nothing is sent back.
+static LV2_Worker_Status
+work_response(LV2_Handle instance, uint32_t size, const void* data)
+{
+    return LV2_WORKER_SUCCESS;
 }
 
 static const void*
 extension_data(const char* uri)
 {
+    static const LV2_State_Interface  state  = { save, restore };
+    static const LV2_Worker_Interface worker = { work, work_response, NULL };
+
+    if (!strcmp(uri, LV2_STATE__interface)) {
+        return &state;
+    }
+    if (!strcmp(uri, LV2_WORKER__interface)) {
+        return &worker;
+    }
     return NULL;
 }
 
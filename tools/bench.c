@@ -0,0 +1,209 @@
+// Offline benchmark of the plugins' run(), see `make bench`.
+//
+// Every case runs a number of instances of a plugin for a fixed amount of
+// audio at a given block size, with a scripted note density, and reports the
+// time per frame, per MIDI event and the 99th percentile of a run() call.
+// The lane cases play the script on 16 channels into a single arpeggiator in
+// multi-lane mode, to compare with 16 instances playing one channel each.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <lv2/lv2plug.in/ns/ext/atom/util.h>
+#include <lv2/lv2plug.in/ns/ext/midi/midi.h>
+
+#include "lv2host.h"
+
+#define SAMPLERATE   48000
+#define BENCH_SECONDS 10
+#define MAX_INSTANCES 64
+#define NUM_LANES     16
+#define ARP_MULTI_LANE_PORT 13
+
+
+typedef struct {
+    const char* name;
+    uint32_t    chord_size;     // notes per chord, 0 for no input at all
+    uint32_t    chord_interval; // frames between chords
+    uint32_t    chord_spread;   // frames between the notes of a chord
+} Density;
+
+static const Density densities[] = {
+    { "idle",   0, 0,     0 },
+    { "chords", 4, 24000, 48 },
+    { "stabs",  8, 3000,  12 },
+};
+
+static const uint32_t block_sizes[]    = { 64, 256, 1024, 4096 };
+static const uint32_t instance_count[] = { 1, 16, 40 };
+
+
+static uint64_t
+nowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+
+static int
+compareTimes(const void* a, const void* b)
+{
+    const uint64_t x = *(const uint64_t*)a;
+    const uint64_t y = *(const uint64_t*)b;
+
+    return (x > y) - (x < y);
+}
+
+
+// Adds the note-ons and note-offs of the density script that fall in the
+// block starting at `start`, on each of the first `channels` MIDI channels.
+static uint32_t
+scriptBlock(HostInstance* inst, const Density* density, uint64_t start, uint32_t n_samples, uint32_t channels)
+{
+    uint32_t events = 0;
+
+    if (density->chord_size == 0) {
+        return 0;
+    }
+
+    const uint64_t release = density->chord_interval / 2;
+    for (uint32_t frame = 0; frame < n_samples; frame++) {
+        const uint64_t time = start + frame;
+        const uint64_t in_chord = time % density->chord_interval;
+        for (uint32_t n = 0; n < density->chord_size; n++) {
+            const uint8_t note = 48 + (uint8_t)((n * 7 + time / density->chord_interval) % 24);
+            for (uint32_t c = 0; c < channels; c++) {
+                if (in_chord == n * density->chord_spread) {
+                    hostAddMidi(inst, frame, LV2_MIDI_MSG_NOTE_ON | c, note, 100);
+                    events++;
+                } else if (in_chord == release + n * density->chord_spread) {
+                    hostAddMidi(inst, frame, LV2_MIDI_MSG_NOTE_OFF | c, note, 0);
+                    events++;
+                }
+            }
+        }
+    }
+
+    return events;
+}
+
+
+static uint32_t
+countOutput(const HostInstance* inst)
+{
+    uint32_t events = 0;
+
+    LV2_ATOM_SEQUENCE_FOREACH(hostOutput(inst), ev) {
+        events++;
+    }
+
+    return events;
+}
+
+
+static bool
+runCase(const HostPlugin* plugin, uint32_t block_size, uint32_t instances, uint32_t channels, const Density* density)
+{
+    HostInstance* insts[MAX_INSTANCES];
+
+    for (uint32_t i = 0; i < instances; i++) {
+        insts[i] = hostInstantiate(plugin, SAMPLERATE);
+        if (!insts[i]) {
+            return false;
+        }
+        if (channels > 1) {
+            insts[i]->controls[ARP_MULTI_LANE_PORT] = 1.0f;
+        }
+    }
+
+    const uint32_t blocks   = BENCH_SECONDS * SAMPLERATE / block_size;
+    uint64_t*      times    = (uint64_t*)malloc(sizeof(uint64_t) * blocks * instances);
+    uint64_t       total_ns = 0;
+    uint64_t       events   = 0;
+    float          beat     = 0.0f;
+
+    for (uint32_t b = 0; b < blocks; b++) {
+        const uint64_t start = (uint64_t)b * block_size;
+
+        for (uint32_t i = 0; i < instances; i++) {
+            hostAddPosition(insts[i], 0, (int64_t)start, beat, 120.0f, 1.0f);
+            events += scriptBlock(insts[i], density, start, block_size, channels);
+
+            const uint64_t t0 = nowNs();
+            hostRun(insts[i], block_size);
+            const uint64_t elapsed = nowNs() - t0;
+
+            times[b * instances + i] = elapsed;
+            total_ns += elapsed;
+            events += countOutput(insts[i]);
+        }
+
+        beat += block_size * 2.0f / SAMPLERATE;
+        beat = (beat >= 4.0f) ? beat - 4.0f : beat;
+    }
+
+    qsort(times, (size_t)blocks * instances, sizeof(uint64_t), compareTimes);
+    const uint64_t p99 = times[(size_t)blocks * instances * 99 / 100];
+
+    const double ns_frame = (double)total_ns / ((double)blocks * block_size * instances);
+    printf("%-16s %6u %5u %4u  %-7s %10.2f ", plugin->name, block_size, instances, channels, density->name, ns_frame);
+    if (events > 0) {
+        printf("%10.1f ", (double)total_ns / events);
+    } else {
+        printf("%10s ", "-");
+    }
+    printf("%12.2f\n", p99 / 1000.0);
+
+    free(times);
+    for (uint32_t i = 0; i < instances; i++) {
+        hostFree(insts[i]);
+    }
+
+    return true;
+}
+
+
+int
+main(int argc, char** argv)
+{
+    const HostPlugin* plugins[] = { &host_arpeggiator, &host_midi_pattern };
+
+    printf("%-16s %6s %5s %4s  %-7s %10s %10s %12s\n",
+            "plugin", "block", "inst", "chan", "notes", "ns/frame", "ns/event", "p99 run(us)");
+
+    for (size_t p = 0; p < sizeof(plugins) / sizeof(plugins[0]); p++) {
+        //only run the plugins given on the command line, if any
+        if (argc > 1) {
+            bool selected = false;
+            for (int a = 1; a < argc; a++) {
+                selected = selected || !strcmp(argv[a], plugins[p]->name);
+            }
+            if (!selected) {
+                continue;
+            }
+        }
+        for (size_t s = 0; s < sizeof(block_sizes) / sizeof(block_sizes[0]); s++) {
+            for (size_t n = 0; n < sizeof(instance_count) / sizeof(instance_count[0]); n++) {
+                for (size_t d = 0; d < sizeof(densities) / sizeof(densities[0]); d++) {
+                    if (!runCase(plugins[p], block_sizes[s], instance_count[n], 1, &densities[d])) {
+                        return 1;
+                    }
+                }
+            }
+            //all channels through the lanes of one arpeggiator
+            if (plugins[p] == &host_arpeggiator) {
+                for (size_t d = 0; d < sizeof(densities) / sizeof(densities[0]); d++) {
+                    if (!runCase(plugins[p], block_sizes[s], 1, NUM_LANES, &densities[d])) {
+                        return 1;
+                    }
+                }
+            }
+        }
+    }
+
+    return 0;
+}
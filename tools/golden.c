@@ -0,0 +1,624 @@
+// Golden output regression test for the plugins, see `make check`.
+//
+// Runs a fixed input script through the arpeggiator for every combination
+// of arp mode, octave mode, octave spread, latch and sync, and compares the
+// MIDI events coming out of run() with the recorded golden files. The
+// settings and plugins that grid leaves alone are covered by a list of
+// cases per family, in a file of their own; in the state family the plugin
+// is saved halfway and a new instance restored from it plays on. With
+// --record the golden files are written instead.
+//
+// Golden file layout, all numbers little endian:
+//   "ARPG", u32 version, u32 number of cases
+//   per case: u8 arp mode, octave mode, octave spread, latch, sync, 3 x pad,
+//             u32 number of events
+//   per event: u32 frame since the start, u8 status, note, velocity, pad
+// The cases of a family have their index in the arp mode byte and zeros in
+// the rest of the header.
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lv2/lv2plug.in/ns/ext/atom/util.h>
+#include <lv2/lv2plug.in/ns/ext/midi/midi.h>
+#include <lv2/lv2plug.in/ns/ext/state/state.h>
+
+#include "lv2host.h"
+
+#define SAMPLERATE     48000
+#define SCRIPT_FRAMES  (SAMPLERATE * 5 / 2)
+#define MAX_EVENTS     4096
+#define GOLDEN_VERSION 1
+
+#define NUM_ARP_MODES    6
+#define NUM_OCTAVE_MODES 4
+#define MAX_SPREAD       4
+#define NUM_SYNC_MODES   3
+
+static const char* const arp_mode_names[NUM_ARP_MODES] = {
+    "up", "down", "up-down", "up-down-alt", "played", "random"
+};
+
+
+typedef struct {
+    uint32_t frame;
+    uint8_t  status;
+    uint8_t  note;
+    uint8_t  velocity;
+} GoldenEvent;
+
+typedef struct {
+    uint8_t     arp_mode;
+    uint8_t     octave_mode;
+    uint8_t     spread;
+    uint8_t     latch;
+    uint8_t     sync;
+    uint32_t    num_events;
+    GoldenEvent events[MAX_EVENTS];
+} GoldenCase;
+
+
+typedef struct {
+    uint32_t frame;
+    uint8_t  status; // with the channel
+    uint8_t  note;
+} ScriptEvent;
+
+// Chord, extra note, partial release, release, then a second chord to
+// exercise latch, with the input spread over block boundaries.
+static const ScriptEvent script[] = {
+    {  4800, LV2_MIDI_MSG_NOTE_ON,  60 },
+    {  4803, LV2_MIDI_MSG_NOTE_ON,  67 },
+    {  4900, LV2_MIDI_MSG_NOTE_ON,  64 },
+    { 30000, LV2_MIDI_MSG_NOTE_ON,  72 },
+    { 50000, LV2_MIDI_MSG_NOTE_OFF, 64 },
+    { 70000, LV2_MIDI_MSG_NOTE_OFF, 60 },
+    { 70010, LV2_MIDI_MSG_NOTE_OFF, 67 },
+    { 70020, LV2_MIDI_MSG_NOTE_OFF, 72 },
+    { 86000, LV2_MIDI_MSG_NOTE_ON,  55 },
+    { 86001, LV2_MIDI_MSG_NOTE_ON,  48 },
+    {105000, LV2_MIDI_MSG_NOTE_OFF, 48 },
+    {105500, LV2_MIDI_MSG_NOTE_OFF, 55 },
+};
+
+// Chords on three channels: a second lane starts while the first plays, and
+// the first changes its chord legato, all for the channel lanes.
+static const ScriptEvent lanes_script[] = {
+    {  4800, LV2_MIDI_MSG_NOTE_ON,        60 },
+    {  4805, LV2_MIDI_MSG_NOTE_ON,        64 },
+    {  4900, LV2_MIDI_MSG_NOTE_ON,        67 },
+    { 20000, LV2_MIDI_MSG_NOTE_ON | 1,    48 },
+    { 20100, LV2_MIDI_MSG_NOTE_ON | 1,    52 },
+    { 35000, LV2_MIDI_MSG_NOTE_ON | 2,    72 },
+    { 50000, LV2_MIDI_MSG_NOTE_ON,        62 },
+    { 50200, LV2_MIDI_MSG_NOTE_ON,        65 },
+    { 50300, LV2_MIDI_MSG_NOTE_OFF,       60 },
+    { 50300, LV2_MIDI_MSG_NOTE_OFF,       64 },
+    { 50310, LV2_MIDI_MSG_NOTE_OFF,       67 },
+    { 70000, LV2_MIDI_MSG_NOTE_OFF | 1,   48 },
+    { 70000, LV2_MIDI_MSG_NOTE_OFF | 1,   52 },
+    { 80000, LV2_MIDI_MSG_NOTE_OFF | 2,   72 },
+    {100000, LV2_MIDI_MSG_NOTE_OFF,       62 },
+    {100000, LV2_MIDI_MSG_NOTE_OFF,       65 },
+};
+
+// One pitch held, every step plays it again.
+static const ScriptEvent repeat_script[] = {
+    {  4800, LV2_MIDI_MSG_NOTE_ON,  60 },
+    { 60000, LV2_MIDI_MSG_NOTE_OFF, 60 },
+};
+
+// A note now and then, some of them close together, for the MIDI-pattern to
+// give the velocity of its step.
+static const ScriptEvent pattern_script[] = {
+    {  1000, LV2_MIDI_MSG_NOTE_ON,  60 },
+    {  4000, LV2_MIDI_MSG_NOTE_OFF, 60 },
+    {  7000, LV2_MIDI_MSG_NOTE_ON,  62 },
+    {  7001, LV2_MIDI_MSG_NOTE_ON,  65 },
+    { 12000, LV2_MIDI_MSG_NOTE_OFF, 62 },
+    { 12000, LV2_MIDI_MSG_NOTE_OFF, 65 },
+    { 14999, LV2_MIDI_MSG_NOTE_ON,  64 },
+    { 15000, LV2_MIDI_MSG_NOTE_OFF, 64 },
+    { 21500, LV2_MIDI_MSG_NOTE_ON,  67 },
+    { 26000, LV2_MIDI_MSG_NOTE_ON,  69 },
+    { 33000, LV2_MIDI_MSG_NOTE_OFF, 67 },
+    { 33100, LV2_MIDI_MSG_NOTE_OFF, 69 },
+    { 40000, LV2_MIDI_MSG_NOTE_ON,  60 },
+    { 43000, LV2_MIDI_MSG_NOTE_OFF, 60 },
+    { 47123, LV2_MIDI_MSG_NOTE_ON,  71 },
+    { 52000, LV2_MIDI_MSG_NOTE_OFF, 71 },
+    { 55555, LV2_MIDI_MSG_NOTE_ON,  72 },
+    { 58000, LV2_MIDI_MSG_NOTE_OFF, 72 },
+    { 63000, LV2_MIDI_MSG_NOTE_ON,  60 },
+    { 63000, LV2_MIDI_MSG_NOTE_ON,  64 },
+    { 63000, LV2_MIDI_MSG_NOTE_ON,  67 },
+    { 70000, LV2_MIDI_MSG_NOTE_OFF, 60 },
+    { 70000, LV2_MIDI_MSG_NOTE_OFF, 64 },
+    { 70000, LV2_MIDI_MSG_NOTE_OFF, 67 },
+    { 77777, LV2_MIDI_MSG_NOTE_ON,  62 },
+    { 80000, LV2_MIDI_MSG_NOTE_OFF, 62 },
+    { 88000, LV2_MIDI_MSG_NOTE_ON,  65 },
+    { 91000, LV2_MIDI_MSG_NOTE_OFF, 65 },
+    { 99000, LV2_MIDI_MSG_NOTE_ON,  67 },
+    {102000, LV2_MIDI_MSG_NOTE_OFF, 67 },
+    {108000, LV2_MIDI_MSG_NOTE_ON,  69 },
+    {111000, LV2_MIDI_MSG_NOTE_OFF, 69 },
+    {115000, LV2_MIDI_MSG_NOTE_ON,  60 },
+    {118000, LV2_MIDI_MSG_NOTE_OFF, 60 },
+};
+
+static const uint32_t block_sizes[] = { 128, 64, 256, 37 };
+
+#define SCRIPT(events) events, sizeof(events) / sizeof(events[0])
+
+
+typedef struct {
+    uint8_t   port; // 0 ends the list, it is never a control
+    float     value;
+} ControlValue;
+
+// One run of a script through a plugin, with the controls that differ from
+// the defaults of the host.
+typedef struct {
+    const char*        name;
+    const HostPlugin*  plugin;
+    const ScriptEvent* script;
+    size_t             script_length;
+    bool               gate; // the changes of the gate output are recorded as status 0 events
+    ControlValue       controls[16];
+} FeatureCase;
+
+typedef struct {
+    const char*        file;
+    const FeatureCase* cases;
+    size_t             num_cases;
+    uint32_t           round_trip; // frame the state moves into a new instance on, 0 for never
+} FeatureFamily;
+
+
+// Faders that all give a different velocity, so every step can be told apart.
+#define PATTERN_FADERS \
+    { 6, 10.0f }, { 7, 20.0f }, { 8, 30.0f }, { 9, 40.0f }, { 10, 50.0f }, { 11, 60.0f }, { 12, 70.0f }, { 13, 80.0f }
+
+static const FeatureCase pattern_cases[] = {
+    { "by note",             &host_midi_pattern, SCRIPT(pattern_script), false, { PATTERN_FADERS, { 5, 8.0f } } },
+    { "by host clock",       &host_midi_pattern, SCRIPT(pattern_script), false, { PATTERN_FADERS, { 5, 8.0f }, { 3, 1.0f } } },
+    { "15 step cycle",       &host_midi_pattern, SCRIPT(pattern_script), false, { PATTERN_FADERS, { 5, 5.0f }, { 16, 20.0f }, { 17, 3.0f } } },
+    { "56 step cycle clock", &host_midi_pattern, SCRIPT(pattern_script), false, { PATTERN_FADERS, { 5, 7.0f }, { 3, 1.0f }, { 4, 12.0f }, { 16, 20.0f }, { 17, 8.0f } } },
+    { "probability",         &host_midi_pattern, SCRIPT(pattern_script), false, { PATTERN_FADERS, { 5, 8.0f }, { 15, 50.0f } } },
+    { "accents",             &host_midi_pattern, SCRIPT(pattern_script), false, { PATTERN_FADERS, { 5, 6.0f }, { 15, 70.0f }, { 16, 30.0f }, { 17, 4.0f } } },
+    { "accents host clock",  &host_midi_pattern, SCRIPT(pattern_script), false, { PATTERN_FADERS, { 5, 8.0f }, { 3, 1.0f }, { 16, 50.0f }, { 17, 3.0f } } },
+};
+
+// The arpeggiator settings outside of the grid, each with its own variant of
+// the frame loop.
+static const FeatureCase arp_cases[] = {
+    { "lanes",                  &host_arpeggiator, SCRIPT(lanes_script), false, { { 13, 1.0f } } },
+    { "lanes synced",           &host_arpeggiator, SCRIPT(lanes_script), false, { { 13, 1.0f }, { 7, 1.0f } } },
+    { "lanes host grid latch",  &host_arpeggiator, SCRIPT(lanes_script), false, { { 13, 1.0f }, { 7, 2.0f }, { 5, 1.0f } } },
+    { "held notes gate",        &host_arpeggiator, SCRIPT(script),       true,  { { 14, 0.0f } } },
+    { "steps gate",             &host_arpeggiator, SCRIPT(script),       true,  { { 14, 1.0f } } },
+    { "steps gate host grid",   &host_arpeggiator, SCRIPT(script),       true,  { { 14, 1.0f }, { 7, 2.0f }, { 8, 0.3f } } },
+    { "lanes steps gate",       &host_arpeggiator, SCRIPT(lanes_script), true,  { { 13, 1.0f }, { 14, 1.0f } } },
+    { "full length repeat",     &host_arpeggiator, SCRIPT(repeat_script), false, { { 8, 1.0f } } },
+    { "full length host grid",  &host_arpeggiator, SCRIPT(repeat_script), false, { { 8, 1.0f }, { 7, 2.0f }, { 6, 12.0f } } },
+    { "bypass",                 &host_arpeggiator, SCRIPT(script),       false, { { 12, 0.0f } } },
+    { "chord window",           &host_arpeggiator, SCRIPT(script),       false, { { 19, 10.0f } } },
+    { "chord window step sync", &host_arpeggiator, SCRIPT(script),       false, { { 20, 0.25f }, { 7, 1.0f } } },
+    { "chord window host grid", &host_arpeggiator, SCRIPT(script),       false, { { 19, 10.0f }, { 7, 2.0f } } },
+    { "chord window lanes",     &host_arpeggiator, SCRIPT(lanes_script), false, { { 19, 10.0f }, { 13, 1.0f } } },
+    { "random seed",            &host_arpeggiator, SCRIPT(script),       false, { { 4, 5.0f }, { 17, 7.0f } } },
+    { "random no repeat",       &host_arpeggiator, SCRIPT(script),       false, { { 4, 5.0f }, { 17, 7.0f }, { 18, 1.0f } } },
+    { "random weighted",        &host_arpeggiator, SCRIPT(script),       false, { { 4, 5.0f }, { 17, 7.0f }, { 18, 2.0f }, { 9, 2.0f } } },
+};
+
+// Saved halfway and restored into a new instance that plays on, after the
+// keys of the first chord are released and before the second one.
+static const FeatureCase state_cases[] = {
+    { "arp latch",            &host_arpeggiator,  SCRIPT(script),         false, { { 5, 1.0f }, { 9, 2.0f } } },
+    { "arp latch host grid",  &host_arpeggiator,  SCRIPT(script),         false, { { 5, 1.0f }, { 4, 2.0f }, { 7, 2.0f } } },
+    { "arp lanes latch",      &host_arpeggiator,  SCRIPT(lanes_script),   false, { { 5, 1.0f }, { 13, 1.0f } } },
+    { "arp random latch",     &host_arpeggiator,  SCRIPT(script),         false, { { 5, 1.0f }, { 4, 5.0f }, { 17, 3.0f }, { 18, 2.0f } } },
+    { "arp random",           &host_arpeggiator,  SCRIPT(script),         false, { { 4, 5.0f }, { 17, 3.0f } } },
+    { "pattern",              &host_midi_pattern, SCRIPT(pattern_script), false, { PATTERN_FADERS, { 5, 7.0f }, { 15, 50.0f }, { 17, 5.0f } } },
+    { "pattern host clock",   &host_midi_pattern, SCRIPT(pattern_script), false, { PATTERN_FADERS, { 5, 8.0f }, { 3, 1.0f }, { 15, 60.0f }, { 17, 3.0f } } },
+};
+
+static const FeatureFamily families[] = {
+    { "arp-features", arp_cases, sizeof(arp_cases) / sizeof(arp_cases[0]), 0 },
+    { "pattern", pattern_cases, sizeof(pattern_cases) / sizeof(pattern_cases[0]), 0 },
+    { "state", state_cases, sizeof(state_cases) / sizeof(state_cases[0]), 80000 },
+};
+
+
+// The saved state of a plugin, kept by the host between save and restore.
+typedef struct {
+    uint8_t   data[8192];
+    size_t    size;
+    uint32_t  key;
+    uint32_t  type;
+} SavedState;
+
+
+static LV2_State_Status
+storeState(LV2_State_Handle handle, uint32_t key, const void* value, size_t size, uint32_t type, uint32_t flags)
+{
+    SavedState* saved = (SavedState*)handle;
+
+    if (size > sizeof(saved->data)) {
+        return LV2_STATE_ERR_NO_SPACE;
+    }
+    memcpy(saved->data, value, size);
+    saved->size = size;
+    saved->key  = key;
+    saved->type = type;
+
+    return LV2_STATE_SUCCESS;
+}
+
+
+static const void*
+retrieveState(LV2_State_Handle handle, uint32_t key, size_t* size, uint32_t* type, uint32_t* flags)
+{
+    const SavedState* saved = (const SavedState*)handle;
+
+    if (key != saved->key) {
+        return NULL;
+    }
+    *size  = saved->size;
+    *type  = saved->type;
+    *flags = LV2_STATE_IS_POD | LV2_STATE_IS_PORTABLE;
+
+    return saved->data;
+}
+
+
+// Saves the state of an instance and restores it into a new one with the
+// same controls, which takes its place. NULL when that fails.
+static HostInstance*
+moveState(HostInstance* inst)
+{
+    static SavedState saved;
+
+    const LV2_State_Interface* state = (const LV2_State_Interface*)inst->descriptor->extension_data(LV2_STATE__interface);
+    HostInstance* next = hostInstantiate(inst->plugin, SAMPLERATE);
+
+    if (!state || !next || state->save(inst->handle, storeState, &saved, 0, NULL) != LV2_STATE_SUCCESS
+            || state->restore(next->handle, retrieveState, &saved, 0, NULL) != LV2_STATE_SUCCESS) {
+        fprintf(stderr, "golden: the state of %s could not be moved\n", inst->plugin->name);
+        if (next) {
+            hostFree(next);
+        }
+        hostFree(inst);
+        return NULL;
+    }
+
+    memcpy(next->controls, inst->controls, sizeof(next->controls));
+    hostFree(inst);
+
+    return next;
+}
+
+
+static bool
+runCase(const FeatureCase* feature, uint32_t round_trip, GoldenCase* c)
+{
+    HostInstance* inst = hostInstantiate(feature->plugin, SAMPLERATE);
+    if (!inst) {
+        return false;
+    }
+
+    for (const ControlValue* control = feature->controls; control->port != 0; control++) {
+        inst->controls[control->port] = control->value;
+    }
+
+    const ScriptEvent* const events = feature->script;
+    float    gate  = 0.0f;
+    size_t   next  = 0;
+    uint32_t start = 0;
+    uint32_t block = 0;
+    c->num_events = 0;
+
+    while (start < SCRIPT_FRAMES) {
+        const uint32_t n_samples = block_sizes[block++ % (sizeof(block_sizes) / sizeof(block_sizes[0]))];
+        const float    beat      = (float)start * 2.0f / SAMPLERATE;
+
+        if (round_trip > 0 && start >= round_trip) {
+            inst = moveState(inst);
+            if (!inst) {
+                return false;
+            }
+            round_trip = 0;
+        }
+
+        hostAddPosition(inst, 0, start, beat - 4.0f * (int)(beat / 4.0f), 120.0f, 1.0f);
+        while (next < feature->script_length && events[next].frame < start + n_samples) {
+            hostAddMidi(inst, events[next].frame - start, events[next].status, events[next].note,
+                    ((events[next].status & 0xF0) == LV2_MIDI_MSG_NOTE_ON) ? 100 : 0);
+            next++;
+        }
+        hostRun(inst, n_samples);
+
+        LV2_ATOM_SEQUENCE_FOREACH(hostOutput(inst), ev) {
+            const uint8_t* const msg = (const uint8_t*)(ev + 1);
+            if (c->num_events < MAX_EVENTS) {
+                GoldenEvent* event = &c->events[c->num_events++];
+                event->frame    = start + (uint32_t)ev->time.frames;
+                event->status   = msg[0];
+                event->note     = msg[1];
+                event->velocity = msg[2];
+            }
+        }
+        for (uint32_t i = 0; feature->gate && i < n_samples; i++) {
+            if (inst->cv[i] != gate && c->num_events < MAX_EVENTS) {
+                gate = inst->cv[i];
+                GoldenEvent* event = &c->events[c->num_events++];
+                event->frame    = start + i;
+                event->status   = 0;
+                event->note     = (gate > 0.5f) ? 1 : 0;
+                event->velocity = 0;
+            }
+        }
+        start += n_samples;
+    }
+
+    hostFree(inst);
+
+    return true;
+}
+
+
+
+static void
+writeU32(FILE* f, uint32_t value)
+{
+    const uint8_t bytes[4] = {
+        (uint8_t)value, (uint8_t)(value >> 8), (uint8_t)(value >> 16), (uint8_t)(value >> 24)
+    };
+    fwrite(bytes, 1, 4, f);
+}
+
+
+static bool
+readU32(FILE* f, uint32_t* value)
+{
+    uint8_t bytes[4];
+    if (fread(bytes, 1, 4, f) != 4) {
+        return false;
+    }
+    *value = bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+
+    return true;
+}
+
+
+static void
+writeCase(FILE* f, const GoldenCase* c)
+{
+    const uint8_t header[8] = { c->arp_mode, c->octave_mode, c->spread, c->latch, c->sync, 0, 0, 0 };
+
+    fwrite(header, 1, 8, f);
+    writeU32(f, c->num_events);
+    for (uint32_t i = 0; i < c->num_events; i++) {
+        const uint8_t msg[4] = { c->events[i].status, c->events[i].note, c->events[i].velocity, 0 };
+        writeU32(f, c->events[i].frame);
+        fwrite(msg, 1, 4, f);
+    }
+}
+
+
+static bool
+readCase(FILE* f, GoldenCase* c)
+{
+    uint8_t header[8];
+
+    if (fread(header, 1, 8, f) != 8 || !readU32(f, &c->num_events) || c->num_events > MAX_EVENTS) {
+        return false;
+    }
+    c->arp_mode    = header[0];
+    c->octave_mode = header[1];
+    c->spread      = header[2];
+    c->latch       = header[3];
+    c->sync        = header[4];
+
+    for (uint32_t i = 0; i < c->num_events; i++) {
+        uint8_t msg[4];
+        if (!readU32(f, &c->events[i].frame) || fread(msg, 1, 4, f) != 4) {
+            return false;
+        }
+        c->events[i].status   = msg[0];
+        c->events[i].note     = msg[1];
+        c->events[i].velocity = msg[2];
+    }
+
+    return true;
+}
+
+
+// Returns the index of the first differing event, or -1 when equal.
+static int
+compareCase(const GoldenCase* expected, const GoldenCase* actual)
+{
+    const uint32_t n = (expected->num_events < actual->num_events) ? expected->num_events : actual->num_events;
+
+    for (uint32_t i = 0; i < n; i++) {
+        const GoldenEvent* a = &expected->events[i];
+        const GoldenEvent* b = &actual->events[i];
+        if (a->frame != b->frame || a->status != b->status || a->note != b->note || a->velocity != b->velocity) {
+            return (int)i;
+        }
+    }
+
+    return (expected->num_events == actual->num_events) ? -1 : (int)n;
+}
+
+
+static void
+printEvent(const char* label, const GoldenCase* c, int index)
+{
+    if (index < (int)c->num_events) {
+        const GoldenEvent* e = &c->events[index];
+        fprintf(stderr, "    %s: frame %u status 0x%02x note %u velocity %u\n",
+                label, e->frame, e->status, e->note, e->velocity);
+    } else {
+        fprintf(stderr, "    %s: no event\n", label);
+    }
+}
+
+
+
+// Opens a golden file and writes or checks its header, NULL on failure.
+static FILE*
+openGolden(const char* path, bool record, uint32_t num_cases)
+{
+    FILE* f = fopen(path, record ? "wb" : "rb");
+    if (!f) {
+        fprintf(stderr, "golden: cannot open %s\n", path);
+        return NULL;
+    }
+
+    if (record) {
+        fwrite("ARPG", 1, 4, f);
+        writeU32(f, GOLDEN_VERSION);
+        writeU32(f, num_cases);
+        return f;
+    }
+
+    char     magic[4];
+    uint32_t version, count;
+    if (fread(magic, 1, 4, f) != 4 || memcmp(magic, "ARPG", 4) || !readU32(f, &version)
+            || version != GOLDEN_VERSION || !readU32(f, &count) || count != num_cases) {
+        fprintf(stderr, "golden: %s is not a golden file of this version\n", path);
+        fclose(f);
+        return NULL;
+    }
+    return f;
+}
+
+
+// Runs a case and records or compares it. Returns false when the file could
+// not be read, a difference is counted in failures.
+static bool
+checkCase(FILE* f, const char* path, bool record, const FeatureCase* feature, uint32_t round_trip,
+          GoldenCase* actual, unsigned* failures)
+{
+    static GoldenCase expected;
+
+    if (!runCase(feature, round_trip, actual)) {
+        return false;
+    }
+
+    if (record) {
+        writeCase(f, actual);
+        return true;
+    }
+
+    if (!readCase(f, &expected)) {
+        fprintf(stderr, "golden: %s is truncated\n", path);
+        return false;
+    }
+    const int diff = compareCase(&expected, actual);
+    if (diff >= 0) {
+        if (feature->name) {
+            fprintf(stderr, "FAIL %s, %s: event %d differs\n", path, feature->name, diff);
+        } else {
+            fprintf(stderr, "FAIL arp %s, octave mode %u, spread %u, latch %u, sync %u: event %d differs\n",
+                    arp_mode_names[actual->arp_mode], actual->octave_mode, actual->spread, actual->latch,
+                    actual->sync, diff);
+        }
+        printEvent("expected", &expected, diff);
+        printEvent("actual  ", actual, diff);
+        (*failures)++;
+    }
+    return true;
+}
+
+
+
+int
+main(int argc, char** argv)
+{
+    bool        record = false;
+    const char* dir    = "tools/golden";
+
+    for (int a = 1; a < argc; a++) {
+        if (!strcmp(argv[a], "--record")) {
+            record = true;
+        } else {
+            dir = argv[a];
+        }
+    }
+
+    static GoldenCase actual;
+    const uint32_t grid_cases = NUM_OCTAVE_MODES * MAX_SPREAD * 2 * NUM_SYNC_MODES;
+    uint32_t num_cases = 0;
+    unsigned failures  = 0;
+
+    for (uint8_t arp = 0; arp < NUM_ARP_MODES; arp++) {
+        char path[512];
+        snprintf(path, sizeof(path), "%s/arp-%s.bin", dir, arp_mode_names[arp]);
+
+        FILE* f = openGolden(path, record, grid_cases);
+        if (!f) {
+            return 1;
+        }
+
+        for (uint8_t oct = 0; oct < NUM_OCTAVE_MODES; oct++) {
+            for (uint8_t spread = 1; spread <= MAX_SPREAD; spread++) {
+                for (uint8_t latch = 0; latch < 2; latch++) {
+                    for (uint8_t sync = 0; sync < NUM_SYNC_MODES; sync++) {
+                        //random mode draws from the seed port, left at its default
+                        const FeatureCase grid = {
+                            NULL, &host_arpeggiator, SCRIPT(script), false,
+                            { { 4, arp }, { 5, latch }, { 6, 8.0f }, { 7, sync }, { 8, 0.5f },
+                              { 9, spread }, { 10, oct }, { 11, 100.0f } }
+                        };
+                        actual.arp_mode    = arp;
+                        actual.octave_mode = oct;
+                        actual.spread      = spread;
+                        actual.latch       = latch;
+                        actual.sync        = sync;
+                        if (!checkCase(f, path, record, &grid, 0, &actual, &failures)) {
+                            fclose(f);
+                            return 1;
+                        }
+                    }
+                }
+            }
+        }
+        fclose(f);
+        num_cases += grid_cases;
+    }
+
+    for (size_t family = 0; family < sizeof(families) / sizeof(families[0]); family++) {
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%s.bin", dir, families[family].file);
+
+        FILE* f = openGolden(path, record, (uint32_t)families[family].num_cases);
+        if (!f) {
+            return 1;
+        }
+
+        for (size_t i = 0; i < families[family].num_cases; i++) {
+            memset(&actual, 0, offsetof(GoldenCase, num_events));
+            actual.arp_mode = (uint8_t)i;
+            if (!checkCase(f, path, record, &families[family].cases[i], families[family].round_trip,
+                           &actual, &failures)) {
+                fclose(f);
+                return 1;
+            }
+        }
+        fclose(f);
+        num_cases += (uint32_t)families[family].num_cases;
+    }
+
+    if (record) {
+        printf("golden: recorded %u cases in %s\n", num_cases, dir);
+        return 0;
+    }
+    printf("golden: %u of %u cases differ\n", failures, num_cases);
+
+    return failures ? 1 : 0;
+}
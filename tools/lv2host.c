@@ -0,0 +1,302 @@
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lv2/lv2plug.in/ns/ext/midi/midi.h>
+#include <lv2/lv2plug.in/ns/ext/time/time.h>
+
+#include "lv2host.h"
+
+#define HOST_MAX_URIS 256
+
+
+static const float arpeggiator_defaults[HOST_MAX_PORTS] = {
+    [3]  = 120.0f, // Bpm
+    [4]  = 0.0f,   // arpMode
+    [5]  = 0.0f,   // latchMode
+    [6]  = 8.0f,   // Divisions
+    [7]  = 0.0f,   // sync
+    [8]  = 0.75f,  // noteLength
+    [9]  = 1.0f,   // octaveSpread
+    [10] = 0.0f,   // octaveMode
+    [11] = 60.0f,  // velocity
+    [12] = 1.0f,   // BYPASS
+    [13] = 0.0f,   // multiLane
+    [14] = 0.0f,   // gateMode
+    [15] = 0.0f,   // clockGroup
+    [17] = 0.0f,   // seed
+    [18] = 0.0f,   // randomMode
+    [19] = 0.0f,   // chordWindow
+    [20] = 0.0f,   // chordWindowStep
+};
+
+static const float midi_pattern_defaults[HOST_MAX_PORTS] = {
+    [3]  = 0.0f,   // sync
+    [4]  = 8.0f,   // Divisions
+    [5]  = 4.0f,   // patternlength
+    [6]  = 60.0f, [7]  = 60.0f, [8]  = 60.0f, [9]  = 60.0f,
+    [10] = 60.0f, [11] = 60.0f, [12] = 60.0f, [13] = 60.0f,
+    [14] = 0.0f,   // clockGroup
+    [15] = 100.0f, // probability
+    [16] = 20.0f,  // accent
+    [17] = 0.0f,   // accentEvery
+};
+
+const HostPlugin host_arpeggiator = {
+    "bg-arpeggiator",
+    "arpeggiator/source/bg-arpeggiator.lv2/bg-arpeggiator.so",
+    21, 0, 1, 2, 16,
+    arpeggiator_defaults
+};
+
+const HostPlugin host_midi_pattern = {
+    "bg-midi-pattern",
+    "midi-pattern/source/bg-midi-pattern.lv2/bg-midi-pattern.so",
+    18, 0, 1, 2, HOST_NO_PORT,
+    midi_pattern_defaults
+};
+
+
+static char*    uris[HOST_MAX_URIS];
+static uint32_t num_uris;
+
+static LV2_URID
+mapUri(LV2_URID_Map_Handle handle, const char* uri)
+{
+    for (uint32_t i = 0; i < num_uris; i++) {
+        if (!strcmp(uris[i], uri)) {
+            return i + 1;
+        }
+    }
+    if (num_uris == HOST_MAX_URIS) {
+        fprintf(stderr, "lv2host: out of URIDs\n");
+        return 0;
+    }
+    uris[num_uris] = strdup(uri);
+
+    return ++num_uris;
+}
+
+static LV2_URID_Map       urid_map     = { NULL, mapUri };
+static const LV2_Feature  map_feature  = { LV2_URID__map, &urid_map };
+
+LV2_URID
+hostMap(const char* uri)
+{
+    return mapUri(NULL, uri);
+}
+
+
+
+// Keeps a job until run() returned, a plugin may not see it done in the
+// same block.
+static LV2_Worker_Status
+scheduleWork(LV2_Worker_Schedule_Handle handle, uint32_t size, const void* data)
+{
+    HostInstance* inst = (HostInstance*)handle;
+
+    if (inst->jobs_size + sizeof(uint32_t) + size > HOST_JOBS_SIZE) {
+        return LV2_WORKER_ERR_NO_SPACE;
+    }
+    memcpy(&inst->jobs[inst->jobs_size], &size, sizeof(uint32_t));
+    memcpy(&inst->jobs[inst->jobs_size + sizeof(uint32_t)], data, size);
+    inst->jobs_size += sizeof(uint32_t) + size;
+
+    return LV2_WORKER_SUCCESS;
+}
+
+
+// Responses go straight back to the plugin, no run() is going on.
+static LV2_Worker_Status
+respondWork(LV2_Worker_Respond_Handle handle, uint32_t size, const void* data)
+{
+    HostInstance* inst = (HostInstance*)handle;
+    const LV2_Worker_Interface* worker = (const LV2_Worker_Interface*)inst->descriptor->extension_data(LV2_WORKER__interface);
+
+    return worker->work_response(inst->handle, size, data);
+}
+
+
+static void
+runJobs(HostInstance* inst)
+{
+    const LV2_Worker_Interface* worker = (const LV2_Worker_Interface*)inst->descriptor->extension_data(LV2_WORKER__interface);
+
+    for (uint32_t offset = 0; worker && offset < inst->jobs_size; ) {
+        uint32_t size;
+        memcpy(&size, &inst->jobs[offset], sizeof(uint32_t));
+        worker->work(inst->handle, respondWork, inst, size, &inst->jobs[offset + sizeof(uint32_t)]);
+        offset += sizeof(uint32_t) + size;
+    }
+    inst->jobs_size = 0;
+}
+
+
+
+static const LV2_Descriptor*
+loadDescriptor(const HostPlugin* plugin)
+{
+    void* lib = dlopen(plugin->binary, RTLD_NOW | RTLD_LOCAL);
+    if (!lib) {
+        fprintf(stderr, "lv2host: %s\n", dlerror());
+        return NULL;
+    }
+
+    LV2_Descriptor_Function lv2_descriptor_fn = (LV2_Descriptor_Function)dlsym(lib, "lv2_descriptor");
+    if (!lv2_descriptor_fn) {
+        fprintf(stderr, "lv2host: %s has no lv2_descriptor\n", plugin->binary);
+        return NULL;
+    }
+
+    return lv2_descriptor_fn(0);
+}
+
+
+HostInstance*
+hostInstantiate(const HostPlugin* plugin, double rate)
+{
+    const LV2_Descriptor* descriptor = loadDescriptor(plugin);
+    if (!descriptor) {
+        return NULL;
+    }
+
+    HostInstance* inst = (HostInstance*)calloc(1, sizeof(HostInstance));
+    inst->in_buf  = (uint8_t*)calloc(1, HOST_SEQ_SIZE);
+    inst->out_buf = (uint8_t*)calloc(1, HOST_SEQ_SIZE);
+    inst->notify_buf = (uint8_t*)calloc(1, HOST_SEQ_SIZE);
+    inst->plugin = plugin;
+    inst->descriptor = descriptor;
+    inst->schedule.handle        = inst;
+    inst->schedule.schedule_work = scheduleWork;
+    inst->schedule_feature.URI   = LV2_WORKER__schedule;
+    inst->schedule_feature.data  = &inst->schedule;
+    inst->features[0] = &map_feature;
+    inst->features[1] = &inst->schedule_feature;
+    inst->features[2] = NULL;
+    inst->handle = descriptor->instantiate(descriptor, rate, "", inst->features);
+    if (!inst->handle) {
+        fprintf(stderr, "lv2host: could not instantiate %s\n", plugin->name);
+        hostFree(inst);
+        return NULL;
+    }
+
+    lv2_atom_forge_init(&inst->forge, &urid_map);
+    memcpy(inst->controls, plugin->defaults, sizeof(inst->controls));
+
+    for (uint32_t port = 0; port < plugin->num_ports; port++) {
+        if (port == plugin->midi_in) {
+            descriptor->connect_port(inst->handle, port, inst->in_buf);
+        } else if (port == plugin->midi_out) {
+            descriptor->connect_port(inst->handle, port, inst->out_buf);
+        } else if (port == plugin->cv_port) {
+            descriptor->connect_port(inst->handle, port, inst->cv);
+        } else if (port == plugin->notify) {
+            descriptor->connect_port(inst->handle, port, inst->notify_buf);
+        } else {
+            descriptor->connect_port(inst->handle, port, &inst->controls[port]);
+        }
+    }
+
+    hostBeginInput(inst);
+    descriptor->activate(inst->handle);
+
+    return inst;
+}
+
+
+void
+hostFree(HostInstance* inst)
+{
+    if (inst->handle) {
+        inst->descriptor->deactivate(inst->handle);
+        inst->descriptor->cleanup(inst->handle);
+    }
+    free(inst->in_buf);
+    free(inst->out_buf);
+    free(inst->notify_buf);
+    free(inst);
+}
+
+
+
+void
+hostBeginInput(HostInstance* inst)
+{
+    lv2_atom_forge_set_buffer(&inst->forge, inst->in_buf, HOST_SEQ_SIZE);
+    lv2_atom_forge_sequence_head(&inst->forge, &inst->seq_frame, 0);
+}
+
+
+void
+hostAddMidi(HostInstance* inst, uint32_t frame, uint8_t status, uint8_t note, uint8_t velocity)
+{
+    static LV2_URID midi_event = 0;
+    if (!midi_event) {
+        midi_event = hostMap(LV2_MIDI__MidiEvent);
+    }
+
+    const uint8_t msg[3] = { status, note, velocity };
+
+    lv2_atom_forge_frame_time(&inst->forge, frame);
+    lv2_atom_forge_atom(&inst->forge, 3, midi_event);
+    lv2_atom_forge_write(&inst->forge, msg, 3);
+}
+
+
+void
+hostAddPosition(HostInstance* inst, uint32_t frame, int64_t host_frame, float bar_beat, float bpm, float speed)
+{
+    LV2_Atom_Forge_Frame obj_frame;
+
+    lv2_atom_forge_frame_time(&inst->forge, frame);
+    lv2_atom_forge_object(&inst->forge, &obj_frame, 0, hostMap(LV2_TIME__Position));
+    lv2_atom_forge_key(&inst->forge, hostMap(LV2_TIME__frame));
+    lv2_atom_forge_long(&inst->forge, host_frame);
+    lv2_atom_forge_key(&inst->forge, hostMap(LV2_TIME__beatUnit));
+    lv2_atom_forge_int(&inst->forge, 4);
+    lv2_atom_forge_key(&inst->forge, hostMap(LV2_TIME__beatsPerBar));
+    lv2_atom_forge_float(&inst->forge, 4.0f);
+    lv2_atom_forge_key(&inst->forge, hostMap(LV2_TIME__barBeat));
+    lv2_atom_forge_float(&inst->forge, bar_beat);
+    lv2_atom_forge_key(&inst->forge, hostMap(LV2_TIME__beatsPerMinute));
+    lv2_atom_forge_float(&inst->forge, bpm);
+    lv2_atom_forge_key(&inst->forge, hostMap(LV2_TIME__speed));
+    lv2_atom_forge_float(&inst->forge, speed);
+    lv2_atom_forge_pop(&inst->forge, &obj_frame);
+}
+
+
+void
+hostRun(HostInstance* inst, uint32_t n_samples)
+{
+    lv2_atom_forge_pop(&inst->forge, &inst->seq_frame);
+
+    //the host tells the plugin the capacity of the output in the atom size
+    LV2_Atom_Sequence* out = (LV2_Atom_Sequence*)inst->out_buf;
+    out->atom.type = 0;
+    out->atom.size = HOST_SEQ_SIZE - sizeof(LV2_Atom);
+
+    LV2_Atom_Sequence* notify = (LV2_Atom_Sequence*)inst->notify_buf;
+    notify->atom.type = 0;
+    notify->atom.size = HOST_SEQ_SIZE - sizeof(LV2_Atom);
+
+    inst->descriptor->run(inst->handle, n_samples);
+    runJobs(inst);
+
+    hostBeginInput(inst);
+}
+
+
+const LV2_Atom_Sequence*
+hostOutput(const HostInstance* inst)
+{
+    return (const LV2_Atom_Sequence*)inst->out_buf;
+}
+
+
+const LV2_Atom_Sequence*
+hostNotify(const HostInstance* inst)
+{
+    return (const LV2_Atom_Sequence*)inst->notify_buf;
+}
@@ -0,0 +1,72 @@
+#ifndef LV2HOST_H
+#define LV2HOST_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <lv2/lv2plug.in/ns/lv2core/lv2.h>
+#include <lv2/lv2plug.in/ns/ext/atom/forge.h>
+#include <lv2/lv2plug.in/ns/ext/urid/urid.h>
+#include <lv2/lv2plug.in/ns/ext/worker/worker.h>
+
+// Minimal offline LV2 host used by the benchmark and the regression tests.
+// It loads a plugin binary through lv2_descriptor(), provides urid:map and
+// drives run() with scripted atom sequences. Worker jobs a plugin schedules
+// in run() are done right after it returns.
+
+#define HOST_MAX_PORTS  32
+#define HOST_MAX_BLOCK  8192
+#define HOST_SEQ_SIZE   65536
+#define HOST_NO_PORT    UINT32_MAX
+#define HOST_JOBS_SIZE  1024
+
+
+typedef struct {
+    const char*  name;
+    const char*  binary;      // path of the plugin shared object
+    uint32_t     num_ports;
+    uint32_t     midi_in;
+    uint32_t     midi_out;
+    uint32_t     cv_port;     // audio rate port, input or output
+    uint32_t     notify;      // optional atom output, HOST_NO_PORT when there is none
+    const float* defaults;    // control port defaults, indexed by port
+} HostPlugin;
+
+
+typedef struct {
+    const HostPlugin*     plugin;
+    const LV2_Descriptor* descriptor;
+    LV2_Handle            handle;
+    LV2_Atom_Forge        forge;
+    LV2_Atom_Forge_Frame  seq_frame;
+    float                 controls[HOST_MAX_PORTS];
+    float                 cv[HOST_MAX_BLOCK];
+    uint8_t*              in_buf;
+    uint8_t*              out_buf;
+    uint8_t*              notify_buf;
+    LV2_Worker_Schedule   schedule;
+    LV2_Feature           schedule_feature;
+    const LV2_Feature*    features[3];
+    uint8_t               jobs[HOST_JOBS_SIZE]; // size and body of every job scheduled in run()
+    uint32_t              jobs_size;
+} HostInstance;
+
+
+extern const HostPlugin host_arpeggiator;
+extern const HostPlugin host_midi_pattern;
+
+LV2_URID      hostMap(const char* uri);
+
+HostInstance* hostInstantiate(const HostPlugin* plugin, double rate);
+void          hostFree(HostInstance* inst);
+
+// Input sequence for the next run(), events have to be added in frame order.
+void          hostBeginInput(HostInstance* inst);
+void          hostAddMidi(HostInstance* inst, uint32_t frame, uint8_t status, uint8_t note, uint8_t velocity);
+void          hostAddPosition(HostInstance* inst, uint32_t frame, int64_t host_frame, float bar_beat, float bpm, float speed);
+void          hostRun(HostInstance* inst, uint32_t n_samples);
+
+const LV2_Atom_Sequence* hostOutput(const HostInstance* inst);
+const LV2_Atom_Sequence* hostNotify(const HostInstance* inst);
+
+#endif